@@ -0,0 +1,26 @@
+# Compares output size, conversion time and read time of the dataset layouts.
+# Expects DATADIR to point to the test circuits, additional arguments are
+# passed to srun.
+input=$DATADIR/cellular/circuit-2k/touches/functional/circuit.parquet
+
+run() {
+    name=$1
+    shift
+    rm -f bench_${name}.h5
+    start=$(date +%s.%N)
+    srun "$@" parquet2hdf5 --no-index $LAYOUT $input bench_${name}.h5 All > /dev/null
+    written=$(date +%s.%N)
+    h5dump -b LE -o /dev/null bench_${name}.h5 > /dev/null
+    read=$(date +%s.%N)
+    printf "%-24s %14d bytes %10.2fs write %10.2fs read\n" \
+        $name $(stat -c %s bench_${name}.h5) \
+        $(echo "$written - $start" | bc) $(echo "$read - $written" | bc)
+}
+
+LAYOUT="" run contiguous "$@"
+LAYOUT="--chunk-size 1048576" run chunked "$@"
+LAYOUT="--compression deflate --compression-level 1" run deflate1 "$@"
+LAYOUT="--compression deflate --compression-level 1 --shuffle" run shuffle_deflate1 "$@"
+LAYOUT="--compression deflate --compression-level 4 --shuffle" run shuffle_deflate4 "$@"
+LAYOUT="--compression deflate --compression-level 9 --shuffle" run shuffle_deflate9 "$@"
+LAYOUT="--compression szip --shuffle" run shuffle_szip "$@"
@@ -0,0 +1,29 @@
+# Compares conversion times for the Parquet reader settings.
+# Expects INPUT to point to a directory of Parquet files (defaults to the
+# multi-file test circuit), additional arguments are passed to srun.
+input=${INPUT:-$DATADIR/cellular/circuit-2k/touches/functional/circuit.parquet}
+
+run() {
+    name=$1
+    shift
+    rm -f bench_${name}.h5
+    # Start every run from a cold page cache where permitted
+    sync && (echo 3 > /proc/sys/vm/drop_caches) 2> /dev/null
+    start=$(date +%s.%N)
+    srun "$@" parquet2hdf5 --no-index $READER $input bench_${name}.h5 All > /dev/null
+    done=$(date +%s.%N)
+    printf "%-32s %10.2fs\n" $name $(echo "$done - $start" | bc)
+    rm -f bench_${name}.h5
+}
+
+READER="" run default "$@"
+READER="--read-buffer-size 1048576" run buffer_1M "$@"
+READER="--read-buffer-size 16777216" run buffer_16M "$@"
+READER="--memory-map" run memory_map "$@"
+READER="--pre-buffer" run pre_buffer "$@"
+READER="--pre-buffer --hole-size-limit 1048576" run pre_buffer_hole_1M "$@"
+READER="--pre-buffer --range-size-limit 8388608" run pre_buffer_range_8M "$@"
+READER="--pre-buffer --hole-size-limit 1048576 --range-size-limit 134217728" run pre_buffer_wide "$@"
+READER="--reader-threads" run threads "$@"
+READER="--pre-buffer --reader-threads" run pre_buffer_threads "$@"
+READER="--memory-map --reader-threads" run memory_map_threads "$@"
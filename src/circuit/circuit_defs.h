@@ -7,6 +7,9 @@
  */
 #pragma once
 
+#include <string>
+#include <unordered_set>
+
 #include <arrow/table.h>
 #include <parquet/schema.h>
 #include <parquet/metadata.h>
@@ -24,6 +27,31 @@ struct CircuitData {
     using Schema = parquet::SchemaDescriptor;
     using Metadata = parquet::KeyValueMetadata;
     std::shared_ptr<arrow::Table> row_group;
+    // Whether row_group holds the last columns of its rows.  If false, the
+    // next block contains further columns of the same rows.
+    bool complete = true;
+};
+
+
+/**
+ * @brief The top-level columns to convert
+ *
+ * Used by the readers to skip decoding unwanted columns and by the writers
+ * to create datasets for the selected columns only.
+ */
+struct ColumnSelection {
+    /// Columns to convert, all if empty
+    std::unordered_set<std::string> include;
+    /// Columns to drop, in addition to the ones never converted
+    std::unordered_set<std::string> exclude;
+
+    inline bool selected(const std::string& name) const {
+        static const std::unordered_set<std::string> never{"synapse_id", "__index_level_0__"};
+        if (never.count(name) > 0 || exclude.count(name) > 0) {
+            return false;
+        }
+        return include.empty() || include.count(name) > 0;
+    }
 };
 
 }  // namespace circuit
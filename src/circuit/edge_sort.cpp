@@ -0,0 +1,169 @@
+/**
+ * Copyright (C) 2018 Blue Brain Project
+ * All rights reserved. Do not distribute without further notice.
+ *
+ */
+#include "edge_sort.h"
+
+#include <algorithm>
+#include <climits>
+#include <numeric>
+#include <stdexcept>
+
+namespace neuron_parquet {
+namespace circuit {
+
+namespace {
+
+/// The positions of \a keys in sorted order
+std::vector<uint64_t> sorted_order(const std::vector<SortKey>& keys) {
+    std::vector<uint64_t> order(keys.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&keys](uint64_t a, uint64_t b) {
+        return keys[a] < keys[b];
+    });
+    return order;
+}
+
+/// Reorders the rows of \a keys and \a columns to follow \a order
+void permute(const std::vector<uint64_t>& order, std::vector<SortKey>& keys, std::vector<EdgeColumn>& columns) {
+    std::vector<SortKey> sorted_keys(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        sorted_keys[i] = keys[order[i]];
+    }
+    keys.swap(sorted_keys);
+
+    for (auto& column: columns) {
+        const auto row_bytes = column.row_bytes;
+        std::vector<uint8_t> sorted(column.data.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            std::copy_n(column.data.data() + order[i] * row_bytes, row_bytes,
+                        sorted.data() + i * row_bytes);
+        }
+        column.data.swap(sorted);
+    }
+}
+
+/// Picks the keys dividing the rows between the \a size ranks, from regular samples of all ranks
+std::vector<SortKey> splitters(MPI_Comm comm, const std::vector<SortKey>& keys, int size) {
+    constexpr int KEY_VALUES = sizeof(SortKey) / sizeof(uint64_t);
+
+    std::vector<SortKey> samples;
+    const uint64_t n = keys.size();
+    const uint64_t n_samples = std::min<uint64_t>(n, size);
+    for (uint64_t i = 0; i < n_samples; ++i) {
+        samples.push_back(keys[i * n / n_samples]);
+    }
+
+    int local_count = samples.size() * KEY_VALUES;
+    std::vector<int> counts(size), offsets(size);
+    MPI_Allgather(&local_count, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+    std::partial_sum(counts.begin(), counts.end() - 1, offsets.begin() + 1);
+
+    std::vector<SortKey> all((offsets.back() + counts.back()) / KEY_VALUES);
+    MPI_Allgatherv(samples.data(), local_count, MPI_UINT64_T,
+                   all.data(), counts.data(), offsets.data(), MPI_UINT64_T, comm);
+    std::sort(all.begin(), all.end());
+
+    std::vector<SortKey> result;
+    if (all.empty()) {
+        return result;
+    }
+    for (int rank = 1; rank < size; ++rank) {
+        result.push_back(all[rank * all.size() / size]);
+    }
+    return result;
+}
+
+/// Exchanges rows of \a row_bytes bytes between all ranks
+void exchange_rows(MPI_Comm comm, size_t row_bytes,
+                   const void* send, const std::vector<int>& send_counts, const std::vector<int>& send_offsets,
+                   void* recv, const std::vector<int>& recv_counts, const std::vector<int>& recv_offsets) {
+    MPI_Datatype row;
+    MPI_Type_contiguous(row_bytes, MPI_BYTE, &row);
+    MPI_Type_commit(&row);
+    MPI_Alltoallv(send, send_counts.data(), send_offsets.data(), row,
+                  recv, recv_counts.data(), recv_offsets.data(), row, comm);
+    MPI_Type_free(&row);
+}
+
+}  // unnamed namespace
+
+
+uint64_t sort_edges(MPI_Comm comm, std::vector<SortKey>& keys, std::vector<EdgeColumn>& columns) {
+    for (const auto& column: columns) {
+        if (column.data.size() != keys.size() * column.row_bytes) {
+            throw std::runtime_error("column and sort key lengths differ");
+        }
+    }
+
+    permute(sorted_order(keys), keys, columns);
+
+    int size = 1;
+    if (comm != MPI_COMM_NULL) {
+        MPI_Comm_size(comm, &size);
+    }
+    if (size == 1) {
+        return 0;
+    }
+
+    // Consecutive slices of the sorted keys go to consecutive ranks
+    const auto split = splitters(comm, keys, size);
+    // The counts and displacements of MPI_Alltoallv are ints, in rows
+    std::vector<int> send_counts(size), send_offsets(size);
+    int overflow = 0;
+    uint64_t begin = 0;
+    for (int rank = 0; rank < size; ++rank) {
+        uint64_t end = keys.size();
+        if (rank < static_cast<int>(split.size())) {
+            end = std::lower_bound(keys.begin(), keys.end(), split[rank]) - keys.begin();
+        }
+        if (end - begin > INT_MAX || begin > INT_MAX) {
+            overflow = 1;
+        } else {
+            send_counts[rank] = end - begin;
+            send_offsets[rank] = begin;
+        }
+        begin = end;
+    }
+
+    std::vector<int> recv_counts(size), recv_offsets(size);
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, comm);
+    const uint64_t received = std::accumulate(recv_counts.begin(), recv_counts.end(), uint64_t{0});
+    if (received > INT_MAX) {
+        overflow = 1;
+    }
+    // Thrown on all ranks, the others would wait in the exchange
+    MPI_Allreduce(MPI_IN_PLACE, &overflow, 1, MPI_INT, MPI_MAX, comm);
+    if (overflow) {
+        throw std::runtime_error("too many rows to sort on a single rank, use more ranks");
+    }
+    std::partial_sum(recv_counts.begin(), recv_counts.end() - 1, recv_offsets.begin() + 1);
+
+    // Keys first, then one column at a time to bound the memory needed
+    {
+        std::vector<SortKey> recv_keys(received);
+        exchange_rows(comm, sizeof(SortKey), keys.data(), send_counts, send_offsets,
+                      recv_keys.data(), recv_counts, recv_offsets);
+        keys.swap(recv_keys);
+    }
+    for (auto& column: columns) {
+        std::vector<uint8_t> recv_data(received * column.row_bytes);
+        exchange_rows(comm, column.row_bytes, column.data.data(), send_counts, send_offsets,
+                      recv_data.data(), recv_counts, recv_offsets);
+        column.data.swap(recv_data);
+    }
+
+    // Every rank sent a sorted run, combine them
+    permute(sorted_order(keys), keys, columns);
+
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    uint64_t count = keys.size();
+    uint64_t offset = 0;
+    MPI_Exscan(&count, &offset, 1, MPI_UINT64_T, MPI_SUM, comm);
+    return rank == 0 ? 0 : offset;
+}
+
+}  // namespace circuit
+}  // namespace neuron_parquet
@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2018 Blue Brain Project
+ * All rights reserved. Do not distribute without further notice.
+ *
+ */
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <mpi.h>
+
+namespace neuron_parquet {
+namespace circuit {
+
+/// The position of an edge in the sorted output
+struct SortKey {
+    uint64_t primary;
+    uint64_t secondary;
+    /// Global position in the input, keeps the sort stable
+    uint64_t index;
+
+    inline bool operator<(const SortKey& other) const {
+        if (primary != other.primary) {
+            return primary < other.primary;
+        }
+        if (secondary != other.secondary) {
+            return secondary < other.secondary;
+        }
+        return index < other.index;
+    }
+};
+
+/// The values of a column as consecutive rows of \c row_bytes bytes
+struct EdgeColumn {
+    size_t row_bytes;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * \brief Sorts the rows of \a columns by \a keys across all ranks of \a comm.
+ *
+ * Performs a sample sort: the keys are sorted locally, split between the
+ * ranks by splitters drawn from samples of all ranks, and exchanged together
+ * with the columns.  On return, \a keys and \a columns hold the share of the
+ * globally sorted rows of this rank, which follows the share of all lower
+ * ranks.  Collective, unless \a comm is \c MPI_COMM_NULL which only sorts
+ * locally.
+ *
+ * \returns The global position of the first row kept by this rank
+ */
+uint64_t sort_edges(MPI_Comm comm, std::vector<SortKey>& keys, std::vector<EdgeColumn>& columns);
+
+}  // namespace circuit
+}  // namespace neuron_parquet
@@ -5,17 +5,96 @@
  * @author Fernando Pereira <fernando.pereira@epfl.ch>
  *
  */
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
 #include <stdexcept>
+#include <unordered_map>
+
+#include <arrow/io/caching.h>
+#include <arrow/io/file.h>
+#include <arrow/io/memory.h>
+#include <nlohmann/json.hpp>
+
 #include "parquet_reader.h"
 
 namespace {
 
-std::unique_ptr<parquet::ParquetFileReader> create_reader(const std::string& filename) {
+using neuron_parquet::circuit::ReaderOptions;
+
+// Read buffer when streaming, avoids loading complete column chunks
+constexpr int64_t STREAM_BUFFER_SIZE = 4 * 1024 * 1024;
+
+std::atomic<uint64_t> open_count{0};
+
+/**
+ * \brief Opens \a filename for reading.
+ *
+ * Passing the \a footer avoids reading and parsing the metadata stored in the file.
+ * When memory-mapping, the mapping is returned in \a mapped.
+ */
+std::unique_ptr<parquet::ParquetFileReader> create_reader(
+        const std::string& filename,
+        const ReaderOptions& options = {},
+        const std::shared_ptr<parquet::FileMetaData>& footer = nullptr,
+        std::shared_ptr<arrow::io::MemoryMappedFile>* mapped = nullptr) {
     auto props = parquet::default_reader_properties();
-    // TODO Find out which buffer size may reduce FS reads
-    // props.enable_buffered_stream();
-    // props.set_buffer_size(16 * 1024 * 1024);
-    return parquet::ParquetFileReader::OpenFile(filename, false, props);
+    if (options.memory_map) {
+        // Pages are read straight from the mapping, an extra buffer would only copy them
+        auto file = arrow::io::MemoryMappedFile::Open(filename, arrow::io::FileMode::READ);
+        if (!file.ok()) {
+            throw std::runtime_error(file.status().ToString());
+        }
+        if (mapped) {
+            *mapped = *file;
+        }
+        ++open_count;
+        return parquet::ParquetFileReader::Open(*file, props, footer);
+    }
+    if (options.buffer_size > 0) {
+        props.enable_buffered_stream();
+        props.set_buffer_size(options.buffer_size);
+    } else if (options.streaming()) {
+        props.enable_buffered_stream();
+        props.set_buffer_size(STREAM_BUFFER_SIZE);
+    }
+    ++open_count;
+    return parquet::ParquetFileReader::OpenFile(filename, false, props, footer);
+}
+
+parquet::ArrowReaderProperties arrow_reader_properties(const ReaderOptions& options,
+                                                      const parquet::SchemaDescriptor& schema) {
+    auto props = parquet::default_arrow_reader_properties();
+    // Strings are converted to enumerations, keep them as indices into a dictionary
+    for (int i = 0; i < schema.num_columns(); ++i) {
+        if (schema.Column(i)->physical_type() == parquet::Type::BYTE_ARRAY) {
+            props.set_read_dictionary(i, true);
+        }
+    }
+    props.set_use_threads(options.use_threads);
+    // Pre-buffering would copy data that is already mapped
+    props.set_pre_buffer(options.pre_buffer && !options.memory_map);
+    if (options.pre_buffer && !options.memory_map) {
+        auto cache = arrow::io::CacheOptions::Defaults();
+        cache.hole_size_limit = options.hole_size_limit;
+        cache.range_size_limit = options.range_size_limit;
+        props.set_cache_options(cache);
+    }
+    return props;
+}
+
+std::string serialize_footer(const parquet::FileMetaData& footer) {
+    auto stream = arrow::io::BufferOutputStream::Create();
+    if (!stream.ok()) {
+        throw std::runtime_error(stream.status().ToString());
+    }
+    footer.WriteTo(stream->get());
+    auto buffer = (*stream)->Finish();
+    if (!buffer.ok()) {
+        throw std::runtime_error(buffer.status().ToString());
+    }
+    return (*buffer)->ToString();
 }
 
 }
@@ -23,18 +102,124 @@ std::unique_ptr<parquet::ParquetFileReader> create_reader(const std::string& fil
 namespace neuron_parquet {
 namespace circuit {
 
-CircuitReaderParquet::CircuitReaderParquet(const std::string & filename)
+ParquetInput ParquetInput::scan(const std::string& directory) {
+    namespace fs = std::filesystem;
+
+    ParquetInput input;
+    fs::path p(directory);
+
+    std::vector<std::string> filenames;
+    for (const auto& e: fs::directory_iterator(p)) {
+        auto ep = e.path();
+        if (fs::is_regular_file(ep) && ep.extension() == ".parquet") {
+            filenames.push_back(ep.string());
+        }
+    }
+    std::sort(filenames.begin(), filenames.end());
+
+    // Row groups described by _metadata, referencing files relative to the directory
+    std::unordered_map<std::string, ParquetFileInfo> described;
+    std::unordered_map<std::string, std::vector<int>> described_rowgroups;
+    std::shared_ptr<parquet::FileMetaData> metadata;
+    auto meta = p / "_metadata";
+    if (fs::is_regular_file(meta)) {
+        input.metadata_filename = meta.string();
+        metadata = create_reader(input.metadata_filename)->metadata();
+        for (int i = 0; i < metadata->num_row_groups(); ++i) {
+            const auto rowgroup = metadata->RowGroup(i);
+            if (rowgroup->num_columns() == 0) {
+                continue;
+            }
+            const auto name = (p / rowgroup->ColumnChunk(0)->file_path()).string();
+            auto& info = described[name];
+            info.rowgroup_count++;
+            info.record_count += rowgroup->num_rows();
+            info.max_rowgroup_size = std::max<uint64_t>(info.max_rowgroup_size, rowgroup->num_rows());
+            described_rowgroups[name].push_back(i);
+        }
+    }
+
+    input.files.reserve(filenames.size());
+    input.footers.reserve(filenames.size());
+    for (const auto& name: filenames) {
+        auto it = described.find(name);
+        if (it != described.end()) {
+            input.files.push_back(it->second);
+            input.files.back().filename = name;
+            input.footers.push_back(serialize_footer(*metadata->Subset(described_rowgroups[name])));
+        } else {
+            CircuitReaderParquet reader(name);
+            input.files.push_back({name, reader.block_count(), reader.record_count(), reader.max_block_size()});
+            input.footers.push_back(serialize_footer(*reader.parquet_metadata_));
+        }
+    }
+    return input;
+}
+
+std::shared_ptr<parquet::FileMetaData> ParquetInput::deserialize_footer(const std::string& data) {
+    if (data.empty()) {
+        return nullptr;
+    }
+    uint32_t length = data.size();
+    return parquet::FileMetaData::Make(data.data(), &length);
+}
+
+std::string ParquetInput::serialize() const {
+    nlohmann::json j;
+    j["metadata_filename"] = metadata_filename;
+    j["files"] = nlohmann::json::array();
+    for (const auto& f: files) {
+        j["files"].push_back({f.filename, f.rowgroup_count, f.record_count, f.max_rowgroup_size});
+    }
+    return j.dump();
+}
+
+ParquetInput ParquetInput::deserialize(const std::string& data) {
+    const auto j = nlohmann::json::parse(data);
+    ParquetInput input;
+    input.metadata_filename = j["metadata_filename"].get<std::string>();
+    for (const auto& f: j["files"]) {
+        input.files.push_back({f[0].get<std::string>(),
+                               f[1].get<uint32_t>(),
+                               f[2].get<uint64_t>(),
+                               f[3].get<uint64_t>()});
+    }
+    return input;
+}
+
+///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////
+
+CircuitReaderParquet::CircuitReaderParquet(const std::string & filename, const ReaderOptions& options)
   :
     filename_(filename),
-    reader_(create_reader(filename)),
+    options_(options),
+    reader_(create_reader(filename, options, nullptr, &mapped_)),
     parquet_metadata_(reader_->metadata()),
-    column_count_(parquet_metadata_->num_columns()),
     rowgroup_count_(parquet_metadata_->num_row_groups()),
-    record_count_(parquet_metadata_->num_rows())
+    record_count_(parquet_metadata_->num_rows()),
+    max_rowgroup_size_(0)
+{
+    for (int i = 0; i < parquet_metadata_->num_row_groups(); ++i) {
+        max_rowgroup_size_ = std::max<uint64_t>(max_rowgroup_size_,
+                                                parquet_metadata_->RowGroup(i)->num_rows());
+    }
+}
+
+CircuitReaderParquet::CircuitReaderParquet(const ParquetFileInfo & info, const ReaderOptions& options)
+  :
+    filename_(info.filename),
+    options_(options),
+    parquet_metadata_(info.footer),
+    rowgroup_count_(info.rowgroup_count),
+    record_count_(info.record_count),
+    max_rowgroup_size_(info.max_rowgroup_size)
 {
 }
 
 void CircuitReaderParquet::close() {
+    batch_reader_.reset();
+    mapped_.reset();
     if(data_reader_) {
         data_reader_.reset(nullptr);
     }
@@ -44,12 +229,28 @@ void CircuitReaderParquet::close() {
 }
 
 
-void CircuitReaderParquet::init_data_reader() {
-    if(! reader_) {
-        reader_ = parquet::ParquetFileReader::OpenFile(filename_, false);
+uint64_t CircuitReaderParquet::files_opened() {
+    return open_count;
+}
+
+
+void CircuitReaderParquet::open() {
+    if(! reader_ && ! data_reader_) {
+        // Re-use the footer if we have it
+        reader_ = create_reader(filename_, options_, parquet_metadata_, &mapped_);
     }
+    if(! parquet_metadata_) {
+        parquet_metadata_ = reader_->metadata();
+    }
+}
+
+
+void CircuitReaderParquet::init_data_reader() {
+    open();
     // NOTE that reader is unique. We must give it up to the other reader
-    const auto status = parquet::arrow::FileReader::Make(arrow::default_memory_pool(), std::move(reader_), &data_reader_);
+    const auto status = parquet::arrow::FileReader::Make(arrow::default_memory_pool(), std::move(reader_),
+                                                         arrow_reader_properties(options_, *parquet_metadata_->schema()),
+                                                         &data_reader_);
     if (!status.ok()) {
         throw std::runtime_error(status.ToString());
     }
@@ -57,6 +258,182 @@ void CircuitReaderParquet::init_data_reader() {
 }
 
 
+void CircuitReaderParquet::dictionary_values(std::map<std::string, std::set<std::string>>& values) {
+    if (!parquet_metadata_) {
+        open();
+    }
+    // Only top-level string columns are written as enumerations
+    std::vector<int> columns;
+    const auto schema = parquet_metadata_->schema();
+    for (int i = 0; i < schema->num_columns(); ++i) {
+        const auto root = schema->GetColumnRoot(i);
+        if (root->is_primitive() && schema->Column(i)->physical_type() == parquet::Type::BYTE_ARRAY &&
+            options_.columns.selected(root->name())) {
+            columns.push_back(i);
+        }
+    }
+    if (columns.empty() || rowgroup_count_ == 0) {
+        return;
+    }
+
+    // The conversion reads the data through the same reader, if left open
+    if (!data_reader_) {
+        init_data_reader();
+    }
+    for (int i: columns) {
+        const auto name = schema->GetColumnRoot(i)->name();
+        auto& column_values = values[name];
+        for (int rowgroup = 0; rowgroup < (int) rowgroup_count_; ++rowgroup) {
+            if (dictionary_encoded(*parquet_metadata_->RowGroup(rowgroup)->ColumnChunk(i))) {
+                read_dictionary_page(rowgroup, i, column_values);
+                continue;
+            }
+
+            // Values not covered by the dictionary have to be decoded
+            std::shared_ptr<arrow::Table> table;
+            const auto status = data_reader_->ReadRowGroup(rowgroup, {i}, &table);
+            if (!status.ok()) {
+                throw std::runtime_error(status.ToString());
+            }
+            for (const auto& chunk: table->column(0)->chunks()) {
+                std::shared_ptr<arrow::Array> strings = chunk;
+                if (chunk->type_id() == arrow::Type::DICTIONARY) {
+                    strings = static_cast<const arrow::DictionaryArray&>(*chunk).dictionary();
+                }
+                if (strings->type_id() != arrow::Type::STRING) {
+                    throw std::runtime_error("column " + name + " does not contain strings");
+                }
+                const auto& array = static_cast<const arrow::StringArray&>(*strings);
+                for (int64_t n = 0; n < array.length(); ++n) {
+                    if (array.IsValid(n)) {
+                        column_values.insert(array.GetString(n));
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+bool CircuitReaderParquet::dictionary_encoded(const parquet::ColumnChunkMetaData& chunk) {
+    // Writers fall back to plain encoding once a dictionary grows too large
+    const auto& stats = chunk.encoding_stats();
+    if (!chunk.has_dictionary_page() || stats.empty()) {
+        return false;
+    }
+    for (const auto& page: stats) {
+        if (page.page_type != parquet::PageType::DICTIONARY_PAGE &&
+            page.encoding != parquet::Encoding::PLAIN_DICTIONARY &&
+            page.encoding != parquet::Encoding::RLE_DICTIONARY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void CircuitReaderParquet::read_dictionary_page(int rowgroup, int column, std::set<std::string>& values) {
+    auto pages = data_reader_->parquet_reader()->RowGroup(rowgroup)->GetColumnPageReader(column);
+    // The dictionary page comes first, the data pages are not read
+    const auto page = pages->NextPage();
+    if (!page || page->type() != parquet::PageType::DICTIONARY_PAGE) {
+        throw std::runtime_error("missing dictionary page in " + filename_);
+    }
+    const auto& dictionary = static_cast<const parquet::DictionaryPage&>(*page);
+    // Plain encoded byte arrays: a 4 byte little-endian length followed by the bytes
+    const uint8_t* data = dictionary.data();
+    const uint8_t* end = data + dictionary.size();
+    for (int32_t n = 0; n < dictionary.num_values(); ++n) {
+        uint32_t length;
+        if (end - data < 4) {
+            throw std::runtime_error("corrupt dictionary page in " + filename_);
+        }
+        std::memcpy(&length, data, 4);
+        data += 4;
+        if (static_cast<uint64_t>(end - data) < length) {
+            throw std::runtime_error("corrupt dictionary page in " + filename_);
+        }
+        values.emplace(reinterpret_cast<const char*>(data), length);
+        data += length;
+    }
+}
+
+
+void CircuitReaderParquet::will_need(int rowgroup) const {
+    if (!mapped_) {
+        return;
+    }
+    const auto metadata = parquet_metadata_->RowGroup(rowgroup);
+    std::vector<arrow::io::ReadRange> ranges;
+    for (int i: projection_) {
+        const auto chunk = metadata->ColumnChunk(i);
+        int64_t start = chunk->data_page_offset();
+        if (chunk->has_dictionary_page()) {
+            start = std::min(start, chunk->dictionary_page_offset());
+        }
+        ranges.push_back({start, chunk->total_compressed_size()});
+    }
+    // Only a hint to the kernel, failures are harmless
+    const auto status = mapped_->WillNeed(ranges);
+    (void) status;
+}
+
+
+void CircuitReaderParquet::init_batch_reader() {
+    // Bound the rows per batch by the average uncompressed row size
+    const auto rowgroup = parquet_metadata_->RowGroup(cur_row_group_);
+    int64_t rows = rowgroup->num_rows();
+    if (options_.batch_bytes > 0 && rows > 0) {
+        const int64_t row_bytes = std::max<int64_t>(1, rowgroup->total_byte_size() / rows);
+        rows = std::min<int64_t>(rows, std::max<int64_t>(1, options_.batch_bytes / row_bytes));
+    }
+    if (options_.batch_rows > 0) {
+        rows = std::min<int64_t>(rows, options_.batch_rows);
+    }
+    data_reader_->set_batch_size(std::max<int64_t>(1, rows));
+    will_need(cur_row_group_);
+
+    const auto status = data_reader_->GetRecordBatchReader({static_cast<int>(cur_row_group_++)}, projection_, &batch_reader_);
+    if (!status.ok()) {
+        throw std::runtime_error(status.ToString());
+    }
+}
+
+
+void CircuitReaderParquet::init_column_groups() {
+    // Nested fields span several Parquet columns, which have to be read together
+    const auto schema = parquet_metadata_->schema();
+    std::vector<std::vector<int>> fields;
+    const parquet::schema::Node* last_root = nullptr;
+    for (int i = 0; i < schema->num_columns(); ++i) {
+        const auto root = schema->GetColumnRoot(i);
+        if (!options_.columns.selected(root->name())) {
+            continue;
+        }
+        if (root != last_root) {
+            fields.emplace_back();
+            last_root = root;
+        }
+        fields.back().push_back(i);
+    }
+
+    projection_.clear();
+    column_groups_.clear();
+    const size_t per_read = options_.columns_per_read > 0 ? options_.columns_per_read : fields.size();
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (i % per_read == 0) {
+            column_groups_.emplace_back();
+        }
+        auto& group = column_groups_.back();
+        group.insert(group.end(), fields[i].begin(), fields[i].end());
+        projection_.insert(projection_.end(), fields[i].begin(), fields[i].end());
+    }
+    if (column_groups_.empty()) {
+        throw std::runtime_error("no columns selected to read from " + filename_);
+    }
+}
+
+
 uint32_t CircuitReaderParquet::fillBuffer(CircuitData* buf, uint32_t length) {
     // We are using parquet::arrow::reader to recreate the data
     // parquet::reader is a low-level reader not handling automatically repetition levels, etc...
@@ -65,11 +442,68 @@ uint32_t CircuitReaderParquet::fillBuffer(CircuitData* buf, uint32_t length) {
     if(!data_reader_) {
         init_data_reader();
     }
+    if (column_groups_.empty()) {
+        init_column_groups();
+    }
+
+    // Release the previous block before reading the next one
+    buf->row_group.reset();
+    buf->complete = true;
+
+    if (options_.columns_per_read > 0) {
+        if (cur_row_group_ >= rowgroup_count_) {
+            return 0;
+        }
+        if (cur_column_group_ == 0) {
+            will_need(cur_row_group_);
+        }
+        const auto status = data_reader_->ReadRowGroup(
+            cur_row_group_, column_groups_[cur_column_group_], &(buf->row_group));
+        if (!status.ok()) {
+            throw std::runtime_error(status.ToString());
+        }
+        if (++cur_column_group_ == column_groups_.size()) {
+            cur_column_group_ = 0;
+            ++cur_row_group_;
+        } else {
+            buf->complete = false;
+        }
+        return (uint32_t) buf->row_group->num_rows();
+    }
+
+    if (options_.streaming()) {
+        while (true) {
+            if (!batch_reader_) {
+                if (cur_row_group_ >= rowgroup_count_) {
+                    return 0;
+                }
+                init_batch_reader();
+            }
+            std::shared_ptr<arrow::RecordBatch> batch;
+            const auto status = batch_reader_->ReadNext(&batch);
+            if (!status.ok()) {
+                throw std::runtime_error(status.ToString());
+            }
+            if (!batch) {
+                // Row group exhausted
+                batch_reader_.reset();
+                continue;
+            }
+            auto table = arrow::Table::FromRecordBatches({batch});
+            if (!table.ok()) {
+                throw std::runtime_error(table.status().ToString());
+            }
+            buf->row_group = *table;
+            return (uint32_t) batch->num_rows();
+        }
+    }
+
     if( cur_row_group_ >= rowgroup_count_) {
         return 0;
     }
 
-    const auto status = data_reader_->ReadRowGroup(cur_row_group_++, &(buf->row_group));
+    will_need(cur_row_group_);
+    const auto status = data_reader_->ReadRowGroup(cur_row_group_++, projection_, &(buf->row_group));
     if (!status.ok()) {
         throw std::runtime_error(status.ToString());
     }
@@ -80,19 +514,19 @@ uint32_t CircuitReaderParquet::fillBuffer(CircuitData* buf, uint32_t length) {
 ///////////////////////////////////////////////////////////////////////
 ///////////////////////////////////////////////////////////////////////
 
-CircuitMultiReaderParquet::CircuitMultiReaderParquet(const std::vector<std::string>& filenames, const std::string& metadata_filename)
+CircuitMultiReaderParquet::CircuitMultiReaderParquet(const std::vector<std::string>& filenames, const std::string& metadata_filename,
+                                                     const ReaderOptions& options)
  :
    rowgroup_count_(0),
    record_count_(0),
+   max_rowgroup_size_(0),
    cur_file_(0)
 {
     if (filenames.empty()) {
         throw std::runtime_error("need at least one file to read");
     }
 
-    if (metadata_filename.empty()) {
-        metadata_reader_.reset(new CircuitReaderParquet(filenames[0]));
-    } else {
+    if (!metadata_filename.empty()) {
         metadata_reader_.reset(new CircuitReaderParquet(metadata_filename));
     }
 
@@ -101,18 +535,65 @@ CircuitMultiReaderParquet::CircuitMultiReaderParquet(const std::vector<std::stri
     rowgroup_offsets_.push_back(0);
 
     for(auto name : filenames) {
-        std::shared_ptr<CircuitReaderParquet> reader(new CircuitReaderParquet(name));
-        circuit_readers_.push_back(reader);
-        rowgroup_count_ += reader->rowgroup_count_;
-        record_count_ += reader->record_count_;
-        // Offsets
-        rowgroup_offsets_.push_back(rowgroup_count_);
-
-        //Free file handler
+        std::shared_ptr<CircuitReaderParquet> reader(new CircuitReaderParquet(name, options));
+        add_reader(reader);
+
+        //Free file handler, the footer is kept for re-opening
         reader->close();
     }
 
+    if (!metadata_reader_) {
+        metadata_reader_ = circuit_readers_.front();
+    }
+}
+
+CircuitMultiReaderParquet::CircuitMultiReaderParquet(const std::vector<ParquetFileInfo>& files, const std::string& metadata_filename,
+                                                     const ReaderOptions& options)
+ :
+   rowgroup_count_(0),
+   record_count_(0),
+   max_rowgroup_size_(0),
+   cur_file_(0)
+{
+    if (files.empty()) {
+        throw std::runtime_error("need at least one file to read");
+    }
+
+    circuit_readers_.reserve(files.size());
+    rowgroup_offsets_.reserve(files.size());
+    rowgroup_offsets_.push_back(0);
+
+    for (const auto& info : files) {
+        add_reader(std::make_shared<CircuitReaderParquet>(info, options));
+    }
+
+    if (metadata_filename.empty()) {
+        // The first file is opened here and kept open until its data is read
+        metadata_reader_ = circuit_readers_.front();
+        metadata_reader_->open();
+    } else {
+        metadata_reader_.reset(new CircuitReaderParquet(metadata_filename));
+    }
+}
+
+void CircuitMultiReaderParquet::dictionary_values(std::map<std::string, std::set<std::string>>& values) {
+    for (size_t i = 0; i < circuit_readers_.size(); ++i) {
+        circuit_readers_[i]->dictionary_values(values);
+        // Only the file the conversion starts with stays open, a rank may read
+        // hundreds of files.  The others reuse their footer when reopened.
+        if (i != cur_file_) {
+            circuit_readers_[i]->close();
+        }
+    }
+}
 
+void CircuitMultiReaderParquet::add_reader(const std::shared_ptr<CircuitReaderParquet>& reader) {
+    circuit_readers_.push_back(reader);
+    rowgroup_count_ += reader->rowgroup_count_;
+    record_count_ += reader->record_count_;
+    max_rowgroup_size_ = std::max(max_rowgroup_size_, reader->max_rowgroup_size_);
+    // Offsets
+    rowgroup_offsets_.push_back(rowgroup_count_);
 }
 
 uint32_t CircuitMultiReaderParquet::fillBuffer(CircuitData *buf, uint length) {
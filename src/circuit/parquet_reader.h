@@ -7,8 +7,12 @@
  */
 #pragma once
 
+#include <arrow/io/file.h>
+#include <arrow/record_batch.h>
 #include <parquet/api/reader.h>
 #include <parquet/arrow/reader.h>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include "../generic_reader.h"
@@ -18,11 +22,90 @@ namespace neuron_parquet {
 namespace circuit {
 
 
+/**
+ * @brief Summary of a Parquet file, sufficient to plan the conversion
+ *        without opening the file
+ */
+struct ParquetFileInfo {
+    std::string filename;
+    uint32_t rowgroup_count = 0;
+    uint64_t record_count = 0;
+    uint64_t max_rowgroup_size = 0;
+    /// The file metadata, if known, avoids reading the footer when opening the file
+    std::shared_ptr<parquet::FileMetaData> footer;
+};
+
+
+/**
+ * @brief The Parquet files of an input directory
+ *
+ * Meant to be determined by a single process and shared with all others in
+ * serialized form, to avoid many processes hitting the file system metadata.
+ */
+struct ParquetInput {
+    std::string metadata_filename;
+    std::vector<ParquetFileInfo> files;
+    /// Serialized metadata of \c files, only set by scan() and not part of serialize()
+    std::vector<std::string> footers;
+
+    /**
+     * \brief Lists the Parquet files in \a directory, sorted by name.
+     *
+     * Row group and record counts are taken from the \c _metadata file if present,
+     * otherwise the footers of the individual files are read.
+     */
+    static ParquetInput scan(const std::string& directory);
+
+    std::string serialize() const;
+    static ParquetInput deserialize(const std::string& data);
+
+    static std::shared_ptr<parquet::FileMetaData> deserialize_footer(const std::string& data);
+};
+
+
+/**
+ * @brief Settings for reading the data of Parquet files
+ */
+struct ReaderOptions {
+    /// Split row groups into blocks of at most this many rows, 0 to disable
+    uint64_t batch_rows = 0;
+    /// Split row groups into blocks of at most this many uncompressed bytes, 0 to disable
+    uint64_t batch_bytes = 0;
+    /// Read row groups this many columns at a time, 0 to read all columns at once.
+    /// Takes precedence over streaming.
+    uint32_t columns_per_read = 0;
+    /// Columns to read, all others are not decoded
+    ColumnSelection columns;
+
+    /// Read buffer size in bytes, 0 to read complete column chunks at once
+    int64_t buffer_size = 0;
+    /// Open files memory-mapped rather than reading them, for node-local storage.
+    /// Disables the read buffer and pre-buffering.
+    bool memory_map = false;
+    /// Issue all reads of a row group ahead of decoding, coalescing nearby ranges
+    bool pre_buffer = false;
+    /// With pre-buffering, merge ranges separated by at most this many bytes
+    int64_t hole_size_limit = 8 * 1024;
+    /// With pre-buffering, do not merge ranges beyond this many bytes
+    int64_t range_size_limit = 32 * 1024 * 1024;
+    /// Decode columns with the Arrow thread pool
+    bool use_threads = false;
+
+    /// Whether row groups are streamed in smaller blocks
+    inline bool streaming() const {
+        return batch_rows > 0 || batch_bytes > 0;
+    }
+};
+
+
 class CircuitReaderParquet : public Reader<CircuitData> {
     friend class CircuitMultiReaderParquet;
+    friend struct ParquetInput;
 
  public:
-    explicit CircuitReaderParquet(const std::string & filename);
+    explicit CircuitReaderParquet(const std::string & filename, const ReaderOptions& options = {});
+    /// Creates a reader that only opens the file once data is read
+    explicit CircuitReaderParquet(const ParquetFileInfo & info, const ReaderOptions& options = {});
 
     ~CircuitReaderParquet() {}
 
@@ -38,10 +121,18 @@ class CircuitReaderParquet : public Reader<CircuitData> {
         return rowgroup_count_;
     }
 
+    /// The largest number of records in a single block
+    uint64_t max_block_size() const {
+        return max_rowgroup_size_;
+    }
+
     void seek(uint64_t pos) override {
         cur_row_group_ = pos;
+        cur_column_group_ = 0;
+        batch_reader_.reset();
     }
 
+    /// Reads the next row group, or the next rows or columns of it
     uint32_t fillBuffer(CircuitData* buf, uint length) override;
 
     virtual const CircuitData::Schema* schema() const override {
@@ -52,22 +143,55 @@ class CircuitReaderParquet : public Reader<CircuitData> {
         return parquet_metadata_->key_value_metadata();
     }
 
+    /**
+     * \brief Collects the distinct values of the selected string columns.
+     *
+     * Only the dictionary pages of the column chunks are read, unless some
+     * pages of a chunk are not dictionary encoded.  Values are added to
+     * \a values by column name.  Leaves the file open for the conversion.
+     */
+    void dictionary_values(std::map<std::string, std::set<std::string>>& values);
+
+    /// The number of Parquet files opened by this process
+    static uint64_t files_opened();
+
  private:
+
     const std::string filename_;
+    const ReaderOptions options_;
+    std::shared_ptr<arrow::io::MemoryMappedFile> mapped_;
     std::unique_ptr<parquet::ParquetFileReader> reader_;
     std::shared_ptr<parquet::FileMetaData> parquet_metadata_;
     std::unique_ptr<parquet::arrow::FileReader> data_reader_;
+    std::unique_ptr<arrow::RecordBatchReader> batch_reader_;
 
-    const uint32_t column_count_;
     const uint32_t rowgroup_count_;
     const uint64_t record_count_;
+    uint64_t max_rowgroup_size_;
     uint32_t cur_row_group_;
+    // Parquet column indices of the selected columns
+    std::vector<int> projection_;
+    // Parquet column indices to read together when reading columns at a time
+    std::vector<std::vector<int>> column_groups_;
+    size_t cur_column_group_ = 0;
 
     // Functions which might eventually be classed by friend class CircuitMultiReader
-    /// Closes the underlying file handler.
+    /// Opens the underlying file handler, if not already open.
+    void open();
+    /// Closes the underlying file handler, keeps the footer.
     void close();
     /// Initializes the data reader
     void init_data_reader();
+    /// Asks the kernel to page in the selected columns of \a rowgroup if memory-mapped
+    void will_need(int rowgroup) const;
+    /// Starts streaming the current row group in blocks
+    void init_batch_reader();
+    /// Determines the Parquet columns to read, grouped by top-level field
+    void init_column_groups();
+    /// Whether all data pages of \a chunk refer to its dictionary page
+    static bool dictionary_encoded(const parquet::ColumnChunkMetaData& chunk);
+    /// Adds the values of the dictionary page of \a column in \a rowgroup to \a values
+    void read_dictionary_page(int rowgroup, int column, std::set<std::string>& values);
 };
 
 
@@ -78,7 +202,11 @@ class CircuitReaderParquet : public Reader<CircuitData> {
  */
 class CircuitMultiReaderParquet : public Reader<CircuitData> {
  public:
-    explicit CircuitMultiReaderParquet(const std::vector<std::string> & filenames, const std::string& metadata_filename = "");
+    explicit CircuitMultiReaderParquet(const std::vector<std::string> & filenames, const std::string& metadata_filename = "",
+                                       const ReaderOptions& options = {});
+    /// Reads the files described by \a files, opening them only once data is read
+    explicit CircuitMultiReaderParquet(const std::vector<ParquetFileInfo> & files, const std::string& metadata_filename = "",
+                                       const ReaderOptions& options = {});
 
     ~CircuitMultiReaderParquet() {}
 
@@ -94,6 +222,11 @@ class CircuitMultiReaderParquet : public Reader<CircuitData> {
         return rowgroup_count_;
     }
 
+    /// The largest number of records in a single block
+    uint64_t max_block_size() const {
+        return max_rowgroup_size_;
+    }
+
     void seek(uint64_t pos) override;
 
     uint32_t fillBuffer(CircuitData* buf, uint length) override;
@@ -101,11 +234,18 @@ class CircuitMultiReaderParquet : public Reader<CircuitData> {
     virtual const CircuitData::Schema* schema() const override;
 
     virtual const std::shared_ptr<const CircuitData::Metadata> metadata() const override;
+
+    /// Collects the distinct values of the selected string columns of all files,
+    /// closing all but the file read first to bound the open file descriptors
+    void dictionary_values(std::map<std::string, std::set<std::string>>& values);
  private:
+    void add_reader(const std::shared_ptr<CircuitReaderParquet>& reader);
+
     std::vector<std::shared_ptr<CircuitReaderParquet>> circuit_readers_;
     std::shared_ptr<CircuitReaderParquet> metadata_reader_;
     uint32_t rowgroup_count_;
     uint64_t record_count_;
+    uint64_t max_rowgroup_size_;
     std::vector<uint32_t> rowgroup_offsets_;
     uint32_t cur_row_group_;
     unsigned int cur_file_;
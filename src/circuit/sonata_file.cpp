@@ -5,81 +5,445 @@
  * @author Fernando Pereira <fernando.pereira@epfl.ch>
  *
  */
+#include <algorithm>
+#include <array>
+#include <map>
 #include <unordered_set>
 #include "index/index.h"
 #include "sonata_file.h"
 
 namespace {
 
-auto create_fapl() {
+using neuron_parquet::circuit::SonataFile;
+
+// Upper bound for automatically sized chunks, keeps chunks well within the
+// raw data chunk cache of readers and the compression buffers of writers
+constexpr uint64_t MAX_CHUNK_BYTES = 8 * 1024 * 1024;
+// Rows per chunk if neither the chunk size nor the block size is known
+constexpr uint64_t DEFAULT_CHUNK_ROWS = 1024 * 1024;
+constexpr unsigned SZIP_PIXELS_PER_BLOCK = 16;
+
+// Datasets stored in the population group, all others go to the group "0"
+const std::unordered_set<std::string> TOPLEVEL_DATASETS{
+    "edge_type_id",
+    "source_node_id",
+    "target_node_id"
+};
+
+/// The write size histogram bucket of \a bytes
+size_t log2_bucket(uint64_t bytes) {
+    size_t bucket = 0;
+    while (bytes >>= 1) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+// Objects smaller than this are not aligned to avoid padding metadata
+constexpr hsize_t LUSTRE_ALIGNMENT_THRESHOLD = 64 * 1024;
+
+// Property list entries not provided by HighFive, used with PropertyList::add
+struct Alignment {
+    hsize_t threshold;
+    hsize_t alignment;
+
+    void apply(hid_t fapl) const {
+        H5Pset_alignment(fapl, threshold, alignment);
+    }
+};
+
+struct MetadataBlockSize {
+    hsize_t size;
+
+    void apply(hid_t fapl) const {
+        H5Pset_meta_block_size(fapl, size);
+    }
+};
+
+struct PagedAggregation {
+    hsize_t page_size;
+
+    void apply(hid_t fcpl) const {
+        H5Pset_file_space_strategy(fcpl, H5F_FSPACE_STRATEGY_PAGE, 0, 1);
+        H5Pset_file_space_page_size(fcpl, page_size);
+    }
+};
+
+/// Lets all ranks perform metadata reads and writes collectively
+struct CollectiveMetadata {
+    void apply(hid_t fapl) const {
+        H5Pset_all_coll_metadata_ops(fapl, true);
+        H5Pset_coll_metadata_write(fapl, true);
+    }
+};
+
+auto create_fcpl(const SonataFile::FileTuning& tuning) {
+    HighFive::FileCreateProps fcpl;
+    if (tuning.page_size > 0) {
+        fcpl.add(PagedAggregation{tuning.page_size});
+    }
+    return fcpl;
+}
+
+auto create_fapl(const SonataFile::FileTuning& tuning) {
     HighFive::FileAccessProps fapl;
-    fapl.add(HighFive::MPIOFileAccess{MPI_COMM_WORLD, MPI_INFO_NULL});
+    if (tuning.alignment > 0) {
+        fapl.add(Alignment{tuning.alignment_threshold, tuning.alignment});
+    }
+    if (tuning.metadata_block_size > 0) {
+        fapl.add(MetadataBlockSize{tuning.metadata_block_size});
+    }
+    return fapl;
+}
+
+auto create_fapl(const MPI_Comm& comm, const MPI_Info& info, const SonataFile::FileTuning& tuning) {
+    auto fapl = create_fapl(tuning);
+    fapl.add(HighFive::MPIOFileAccess{comm, info});
+    fapl.add(CollectiveMetadata{});
     return fapl;
 }
 
+void check_filter(H5Z_filter_t filter, const std::string& name) {
+    unsigned int config = 0;
+    if (H5Zfilter_avail(filter) <= 0 ||
+        H5Zget_filter_info(filter, &config) < 0 ||
+        (config & H5Z_FILTER_CONFIG_ENCODE_ENABLED) == 0) {
+        throw std::runtime_error("HDF5 filter not available for writing: " + name);
+    }
+}
+
+/// Returns \a layout once its filters are known to be available, before the output is truncated
+const SonataFile::DatasetLayout& checked_layout(const SonataFile::DatasetLayout& layout) {
+    using Compression = SonataFile::DatasetLayout::Compression;
+    if (layout.compression == Compression::Deflate) {
+        check_filter(H5Z_FILTER_DEFLATE, "deflate");
+    } else if (layout.compression == Compression::Szip) {
+        check_filter(H5Z_FILTER_SZIP, "szip");
+    }
+    if (layout.shuffle) {
+        check_filter(H5Z_FILTER_SHUFFLE, "shuffle");
+    }
+    if (layout.checksum) {
+        check_filter(H5Z_FILTER_FLETCHER32, "fletcher32");
+    }
+    return layout;
+}
+
+/**
+ * \brief Creates the dataset creation properties for \a layout, or returns
+ * \c H5P_DEFAULT for a contiguous dataset.
+ *
+ * Automatic chunks span one block (i.e., the rows of a Parquet row group) as long as
+ * they stay below MAX_CHUNK_BYTES.
+ */
+hid_t create_dcpl(const SonataFile::DatasetLayout& layout,
+                  const SonataFile::FileTuning& tuning,
+                  hid_t h5type,
+                  uint64_t length,
+                  uint64_t width) {
+    using Compression = SonataFile::DatasetLayout::Compression;
+    if (!layout.chunked() || length == 0) {
+        if (tuning.fill_values && !tuning.early_allocation) {
+            return H5P_DEFAULT;
+        }
+        hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+        if (!tuning.fill_values) {
+            H5Pset_fill_time(dcpl, H5D_FILL_TIME_NEVER);
+        }
+        if (tuning.early_allocation) {
+            H5Pset_alloc_time(dcpl, H5D_ALLOC_TIME_EARLY);
+        }
+        return dcpl;
+    }
+
+    uint64_t rows = layout.chunk_size;
+    if (rows == 0) {
+        const uint64_t row_bytes = H5Tget_size(h5type) * width;
+        rows = layout.block_size > 0 ? layout.block_size : DEFAULT_CHUNK_ROWS;
+        rows = std::min(rows, std::max(uint64_t{1}, MAX_CHUNK_BYTES / row_bytes));
+    }
+    std::vector<hsize_t> chunk{std::min(rows, length)};
+    if (width > 1)
+        chunk.push_back(width);
+
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, chunk.size(), chunk.data());
+    if (layout.shuffle) {
+        H5Pset_shuffle(dcpl);
+    }
+    if (layout.compression == Compression::Deflate) {
+        H5Pset_deflate(dcpl, layout.compression_level);
+    } else if (layout.compression == Compression::Szip) {
+        H5Pset_szip(dcpl, H5_SZIP_NN_OPTION_MASK, SZIP_PIXELS_PER_BLOCK);
+    }
+    if (layout.checksum) {
+        // Checksum the data as stored, i.e., after compression
+        H5Pset_fletcher32(dcpl);
+    }
+    if (!layout.filtered()) {
+        // Filtered chunks are only allocated and written once data arrives
+        if (!tuning.fill_values) {
+            H5Pset_fill_time(dcpl, H5D_FILL_TIME_NEVER);
+        }
+        if (tuning.early_allocation) {
+            H5Pset_alloc_time(dcpl, H5D_ALLOC_TIME_EARLY);
+        }
+    }
+    return dcpl;
+}
+
+/// Opens \a filepath to append to, or creates it anew
+HighFive::File open_file(const std::string& filepath, bool append,
+                         const HighFive::FileCreateProps& fcpl, const HighFive::FileAccessProps& fapl) {
+    if (append) {
+        return HighFive::File(filepath, HighFive::File::ReadWrite, fapl);
+    }
+    return HighFive::File(filepath, HighFive::File::Create|HighFive::File::Truncate, fcpl, fapl);
+}
+
+HighFive::Group population_group(HighFive::File& file, const std::string& name, bool append) {
+    if (!append) {
+        return file.createGroup("edges").createGroup(name);
+    }
+    if (!file.exist("edges") || !file.getGroup("edges").exist(name)) {
+        throw std::runtime_error("Cannot append to missing edge population " + name);
+    }
+    return file.getGroup("edges").getGroup(name);
+}
+
+HighFive::Group properties_group(HighFive::Group& population, bool append) {
+    return append ? population.getGroup("0") : population.createGroup("0");
+}
+
 }
 
 namespace neuron_parquet {
 namespace circuit {
 
 
-SonataFile::SonataFile(const std::string& filepath, const std::string &population_name, uint64_t n_records)
+SonataFile::FileTuning SonataFile::FileTuning::lustre(hsize_t stripe_size) {
+    FileTuning tuning;
+    tuning.profile = "lustre";
+    tuning.alignment = stripe_size;
+    tuning.alignment_threshold = std::min(stripe_size, LUSTRE_ALIGNMENT_THRESHOLD);
+    tuning.fill_values = false;
+    tuning.early_allocation = true;
+    tuning.metadata_block_size = stripe_size;
+    tuning.page_size = stripe_size;
+    return tuning;
+}
+
+SonataFile::SonataFile(const std::string& filepath, const std::string &population_name, uint64_t n_records,
+                       const DatasetLayout& layout, const FileTuning& tuning, bool append)
   : parallel_mode_(false),
-    file_(HighFive::File(filepath, HighFive::File::Create|HighFive::File::Truncate)),
-    population_group_(file_.createGroup("edges").createGroup(population_name)),
-    properties_group_(population_group_.createGroup("0")),
+    append_(append),
+    layout_(checked_layout(layout)),
+    tuning_(tuning),
+    file_(open_file(filepath, append, create_fcpl(tuning), create_fapl(tuning))),
+    population_group_(population_group(file_, population_name, append)),
+    properties_group_(properties_group(population_group_, append)),
     n_records_(n_records)
 {
+    if (append_) {
+        find_existing_datasets();
+    } else {
+        write_tuning_attributes();
+    }
 }
 
 SonataFile::SonataFile(const std::string& filepath, const std::string &population_name,
-                                 const MPI_Comm& mpicomm, const MPI_Info& mpiinfo, uint64_t n_records)
+                                 const MPI_Comm& mpicomm, const MPI_Info& mpiinfo, uint64_t n_records,
+                                 const DatasetLayout& layout, const FileTuning& tuning, bool append)
   : parallel_mode_(true),
-    file_(HighFive::File(filepath, HighFive::File::Create|HighFive::File::Truncate, create_fapl())),
-    population_group_(file_.createGroup("edges").createGroup(population_name)),
-    properties_group_(population_group_.createGroup("0")),
+    append_(append),
+    layout_(checked_layout(layout)),
+    tuning_(tuning),
+    file_(open_file(filepath, append, create_fcpl(tuning), create_fapl(mpicomm, mpiinfo, tuning))),
+    population_group_(population_group(file_, population_name, append)),
+    properties_group_(properties_group(population_group_, append)),
     n_records_(n_records)
 {
+    if (append_) {
+        find_existing_datasets();
+    } else {
+        write_tuning_attributes();
+    }
+}
+
+void SonataFile::write_tuning_attributes() {
+    // Ordered, all ranks have to create attributes in the same sequence
+    const std::map<std::string, hsize_t> settings{
+        {"tuning_alignment", tuning_.alignment},
+        {"tuning_alignment_threshold", tuning_.alignment_threshold},
+        {"tuning_fill_values", tuning_.fill_values},
+        {"tuning_early_allocation", tuning_.early_allocation},
+        {"tuning_metadata_block_size", tuning_.metadata_block_size},
+        {"tuning_page_size", tuning_.page_size}
+    };
+    file_.createAttribute<std::string>("tuning_profile", HighFive::DataSpace::From(tuning_.profile))
+        .write(tuning_.profile);
+    for (const auto& [name, value]: settings) {
+        file_.createAttribute<hsize_t>(name, HighFive::DataSpace::From(value)).write(value);
+    }
+}
+
+void SonataFile::find_existing_datasets() {
+    std::vector<std::pair<std::string, HighFive::DataSet>> existing;
+    for (const auto& name: TOPLEVEL_DATASETS) {
+        if (population_group_.exist(name)) {
+            existing.emplace_back(name, population_group_.getDataSet(name));
+        }
+    }
+    for (const auto& name: properties_group_.listObjectNames()) {
+        if (properties_group_.getObjectType(name) == HighFive::ObjectType::Dataset) {
+            existing.emplace_back(name, properties_group_.getDataSet(name));
+        }
+    }
+    if (existing.empty()) {
+        throw std::runtime_error("Cannot append to an edge population without datasets");
+    }
+
+    existing_records_ = existing.front().second.getDimensions()[0];
+    for (const auto& [name, dataset]: existing) {
+        if (dataset.getDimensions()[0] != existing_records_) {
+            throw std::runtime_error("Cannot append, dataset " + name + " differs in length from " +
+                                     existing.front().first);
+        }
+        unopened_.insert(name);
+    }
+}
+
+void SonataFile::check_appended() const {
+    if (!unopened_.empty()) {
+        throw std::runtime_error("Cannot append, the input lacks the existing dataset " + *unopened_.begin());
+    }
+}
+
+void SonataFile::extend_appended() {
+    if (!append_) {
+        return;
+    }
+    for (auto& [name, dataset]: datasets_) {
+        if (!dataset.extend()) {
+            throw std::runtime_error("Cannot extend dataset " + name);
+        }
+    }
 }
 
 void SonataFile::create_dataset(const std::string& name,
                                      hid_t h5type,
                                      uint64_t length,
                                      uint64_t width) {
-    const static std::unordered_set<std::string> TOPLEVEL_DATASETS{
-        "edge_type_id",
-        "source_node_id",
-        "target_node_id"
-    };
-
     if(length==0) length = n_records_;
     if( datasets_.count(name) >0 ) {
         throw std::runtime_error("Attempt to create an existing dataset dataset: " + name);
     }
 
-    if (TOPLEVEL_DATASETS.count(name) > 0) {
-        datasets_[name] = Dataset(population_group_.getId(), name, h5type, length, width, parallel_mode_);
-    } else {
-        datasets_[name] = Dataset(properties_group_.getId(), name, h5type, length, width, parallel_mode_);
+    const hid_t h5_loc = TOPLEVEL_DATASETS.count(name) > 0 ? population_group_.getId()
+                                                           : properties_group_.getId();
+    if (append_) {
+        if (unopened_.erase(name) == 0) {
+            throw std::runtime_error("Cannot append, the population has no dataset " + name);
+        }
+        datasets_[name] = Dataset::open(h5_loc, name, h5type, width, existing_records_ + length,
+                                        parallel_mode_, layout_.staging_size);
+        return;
+    }
+
+    hid_t dcpl = create_dcpl(layout_, tuning_, h5type, length, width);
+    datasets_[name] = Dataset(h5_loc, name, h5type, length, width, parallel_mode_, dcpl, layout_.staging_size);
+    if (dcpl != H5P_DEFAULT) {
+        H5Pclose(dcpl);
     }
 }
 
 void SonataFile::create_attribute(const std::string& name, const std::string& value) {
+    if (append_ && population_group_.hasAttribute(name)) {
+        // Keep the attributes of the existing population
+        return;
+    }
     auto attr = population_group_.createAttribute<std::string>(name, HighFive::DataSpace::From(value));
     attr.write(value);
 }
 
 void SonataFile::create_dataset_attribute(const std::string& dataset, const std::string& name, const std::string& value) {
+    if (append_ && population_group_.getDataSet(dataset).hasAttribute(name)) {
+        return;
+    }
     auto attr = population_group_.getDataSet(dataset).createAttribute<std::string>(name, HighFive::DataSpace::From(value));
     attr.write(value);
 }
 
-void SonataFile::create_library(const std::string& name, const std::vector<std::string>& data) {
-    properties_group_.createDataSet("@library/" + name, data);
+std::vector<std::string> SonataFile::create_library(const std::string& name, const std::vector<std::string>& data) {
+    const std::string path = "@library/" + name;
+    if (!append_ || !properties_group_.exist("@library") || !properties_group_.getGroup("@library").exist(name)) {
+        properties_group_.createDataSet(path, data);
+        return data;
+    }
+
+    // Existing values keep their positions, referenced by the existing rows
+    auto values = existing_library(name);
+    const std::unordered_set<std::string> known(values.begin(), values.end());
+    const auto stored = values.size();
+    for (const auto& value: data) {
+        if (known.count(value) == 0) {
+            values.push_back(value);
+        }
+    }
+    if (values.size() > stored) {
+        // Libraries are small, rewrite them rather than requiring extendible datasets
+        properties_group_.getGroup("@library").unlink(name);
+        properties_group_.createDataSet(path, values);
+    }
+    return values;
 }
 
-void SonataFile::write_indices(size_t source_size, size_t target_size, bool parallel) {
-    indexing::write(population_group_, source_size, target_size);
+std::vector<std::string> SonataFile::existing_library(const std::string& name) {
+    std::vector<std::string> values;
+    if (append_ && properties_group_.exist("@library") && properties_group_.getGroup("@library").exist(name)) {
+        properties_group_.getDataSet("@library/" + name).read(values);
+    }
+    return values;
+}
+
+indexing::Summary SonataFile::write_indices(size_t source_size, size_t target_size, bool parallel,
+                                            const indexing::Options& options) {
+    // The node IDs are read back from the file
+    flush();
+    if (append_ && population_group_.exist("indices")) {
+        // Rebuilt over the existing and appended edges
+        population_group_.unlink("indices");
+    }
+    return indexing::write(population_group_, source_size, target_size, options);
+}
+
+indexing::Summary SonataFile::write_indices(size_t source_size, size_t target_size,
+                                            indexing::FlatRawIndex source_ranges, indexing::FlatRawIndex target_ranges,
+                                            const indexing::Options& options) {
+    flush();
+    if (append_) {
+        return indexing::update(population_group_, source_size, target_size,
+                                std::move(source_ranges), std::move(target_ranges), options);
+    }
+    return indexing::write(population_group_, source_size, target_size,
+                           std::move(source_ranges), std::move(target_ranges), options);
+}
+
+void SonataFile::flush() {
+    for (auto& p: datasets_) {
+        p.second.flush();
+    }
+}
+
+SonataFile::WriteSizes SonataFile::write_sizes() const {
+    WriteSizes sizes{};
+    for (const auto& p: datasets_) {
+        const auto& dataset_sizes = p.second.write_sizes();
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            sizes[i] += dataset_sizes[i];
+        }
+    }
+    return sizes;
 }
 
 SonataFile::Dataset::Dataset(hid_t h5_loc,
@@ -87,22 +451,94 @@ SonataFile::Dataset::Dataset(hid_t h5_loc,
                                   hid_t h5type,
                                   uint64_t length,
                                   uint64_t w,
-                                  bool parallel)
+                                  bool parallel,
+                                  hid_t dcpl,
+                                  uint64_t staging_size)
         : width(w) {
     std::vector<hsize_t> dims{length};
     if (width > 1)
         dims.push_back(width);
-    dspace = H5Screate_simple(dims.size(), dims.data(), NULL);
+    std::vector<hsize_t> maxdims = dims;
+    if (dcpl != H5P_DEFAULT && H5Pget_layout(dcpl) == H5D_CHUNKED) {
+        // Lets later conversions append rows
+        maxdims[0] = H5S_UNLIMITED;
+    }
+    dspace = H5Screate_simple(dims.size(), dims.data(), maxdims.data());
     ds = H5Dcreate2(h5_loc, name.c_str(), h5type, dspace,
-                    H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+                    H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    dtype = h5type;
+    init_transfer(parallel, dcpl, staging_size);
+    valid_.reset(new bool);
+}
+
+SonataFile::Dataset SonataFile::Dataset::open(hid_t h5_loc,
+                                              const std::string& name,
+                                              hid_t h5type,
+                                              uint64_t w,
+                                              uint64_t length,
+                                              bool parallel,
+                                              uint64_t staging_size) {
+    Dataset dataset;
+    dataset.width = w;
+    dataset.dtype = h5type;
+    dataset.ds = H5Dopen2(h5_loc, name.c_str(), H5P_DEFAULT);
+    if (dataset.ds < 0) {
+        throw std::runtime_error("Cannot open dataset " + name);
+    }
+    auto fail = [&dataset](const std::string& message) {
+        H5Dclose(dataset.ds);
+        throw std::runtime_error(message);
+    };
+
+    hid_t type = H5Dget_type(dataset.ds);
+    const bool same_type = H5Tequal(type, h5type) > 0;
+    H5Tclose(type);
+    std::array<hsize_t, 2> dims{0, 1};
+    std::array<hsize_t, 2> maxdims{0, 1};
+    hid_t space = H5Dget_space(dataset.ds);
+    const int rank = H5Sget_simple_extent_dims(space, dims.data(), maxdims.data());
+    H5Sclose(space);
+    if (!same_type || rank != (w > 1 ? 2 : 1) || dims[1] != w) {
+        fail("Cannot append, the type of dataset " + name + " differs from the input");
+    }
+    if (maxdims[0] != H5S_UNLIMITED && maxdims[0] < length) {
+        fail("Cannot append to dataset " + name + ", only chunked datasets can be extended");
+    }
+
+    // Extended by extend() once all datasets are known to match
+    dataset.extent_ = length;
+    dataset.dspace = H5Dget_space(dataset.ds);
+    hid_t dcpl = H5Dget_create_plist(dataset.ds);
+    dataset.init_transfer(parallel, dcpl, staging_size);
+    H5Pclose(dcpl);
+    dataset.valid_.reset(new bool);
+    return dataset;
+}
+
+bool SonataFile::Dataset::extend() {
+    const std::array<hsize_t, 2> dims{extent_, width};
+    if (H5Dset_extent(ds, dims.data()) < 0) {
+        return false;
+    }
+    H5Sclose(dspace);
+    dspace = H5Dget_space(ds);
+    return true;
+}
+
+void SonataFile::Dataset::init_transfer(bool parallel, hid_t dcpl, uint64_t staging_size) {
     if(parallel) {
+        // Parallel writes to filtered datasets are only supported collectively
+        collective_ = dcpl != H5P_DEFAULT && H5Pget_nfilters(dcpl) > 0;
         plist = H5Pcreate(H5P_DATASET_XFER);
-        H5Pset_dxpl_mpio(plist, H5FD_MPIO_INDEPENDENT);
+        H5Pset_dxpl_mpio(plist, collective_ ? H5FD_MPIO_COLLECTIVE : H5FD_MPIO_INDEPENDENT);
     } else {
         plist = H5P_DEFAULT;
     }
-    dtype = h5type;
-    valid_.reset(new bool);
+    row_bytes_ = H5Tget_size(dtype) * width;
+    if (!collective_ && row_bytes_ > 0) {
+        // Collective transfers need one write per block, these are never staged
+        staging_rows_ = staging_size / row_bytes_;
+    }
 }
 
 
@@ -112,6 +548,7 @@ SonataFile::Dataset::~Dataset() {
         return;
     }
 
+    flush();
     H5Sclose(dspace);
     H5Dclose(ds);
     if(plist != H5P_DEFAULT) {
@@ -123,16 +560,86 @@ SonataFile::Dataset::~Dataset() {
 void SonataFile::Dataset::write(const void *buffer,
                                      const hsize_t length,
                                      const hsize_t offset) {
-    hid_t memspace = H5Screate_simple(1, &length, NULL);
-    H5Sselect_hyperslab(dspace, H5S_SELECT_SET, &offset, NULL, &length, NULL);
+    if (length == 0) {
+        write_none();
+        return;
+    }
+    if (staging_rows_ == 0) {
+        write_rows(buffer, length, offset);
+        return;
+    }
+
+    if (staged_rows_ > 0 && offset != staged_offset_ + staged_rows_) {
+        flush();
+    }
+    if (staging_.empty()) {
+        staging_.resize(staging_rows_ * row_bytes_);
+    }
+
+    auto data = static_cast<const uint8_t*>(buffer);
+    hsize_t remaining = length;
+    hsize_t position = offset;
+    while (remaining > 0) {
+        if (staged_rows_ == 0) {
+            staged_offset_ = position;
+            if (position % staging_rows_ == 0 && remaining >= staging_rows_) {
+                // Aligned blocks of at least the buffer size bypass it
+                const hsize_t rows = remaining / staging_rows_ * staging_rows_;
+                write_rows(data, rows, position);
+                data += rows * row_bytes_;
+                position += rows;
+                remaining -= rows;
+                continue;
+            }
+        }
+        // Fill the buffer up to the next multiple of its size in the file
+        const hsize_t end = (staged_offset_ / staging_rows_ + 1) * staging_rows_;
+        const hsize_t rows = std::min(remaining, end - position);
+        std::copy_n(data, rows * row_bytes_, staging_.data() + staged_rows_ * row_bytes_);
+        staged_rows_ += rows;
+        data += rows * row_bytes_;
+        position += rows;
+        remaining -= rows;
+        if (position == end) {
+            flush();
+        }
+    }
+}
+
+void SonataFile::Dataset::flush() {
+    if (staged_rows_ == 0) {
+        return;
+    }
+    write_rows(staging_.data(), staged_rows_, staged_offset_);
+    staged_rows_ = 0;
+}
+
+void SonataFile::Dataset::write_rows(const void *buffer,
+                                     const hsize_t length,
+                                     const hsize_t offset) {
+    // Complete rows, also for datasets with several columns
+    std::array<hsize_t, 2> sizes{length, width};
+    std::array<hsize_t, 2> start{offset, 0};
+    const int rank = width > 1 ? 2 : 1;
+
+    hid_t memspace = H5Screate_simple(rank, sizes.data(), NULL);
+    H5Sselect_hyperslab(dspace, H5S_SELECT_SET, start.data(), NULL, sizes.data(), NULL);
     H5Dwrite(ds, dtype, memspace, dspace, plist, buffer);
     H5Sclose(memspace);
+    ++write_sizes_[log2_bucket(length * row_bytes_)];
 }
 
 void SonataFile::Dataset::write(const void *buffer,
                                      const hsize_t column,
                                      const hsize_t length,
                                      const hsize_t offset) {
+    if (length == 0) {
+        write_none();
+        return;
+    }
+    // Staged rows would overwrite this column when written later
+    flush();
+
     std::array<hsize_t, 2> sizes{length, 1};
     std::array<hsize_t, 2> start{offset, column};
 
@@ -140,6 +647,20 @@ void SonataFile::Dataset::write(const void *buffer,
     H5Sselect_hyperslab(dspace, H5S_SELECT_SET, start.data(), NULL, sizes.data(), NULL);
     H5Dwrite(ds, dtype, memspace, dspace, plist, buffer);
     H5Sclose(memspace);
+    ++write_sizes_[log2_bucket(length * H5Tget_size(dtype))];
+}
+
+void SonataFile::Dataset::write_none() {
+    if (!collective_) {
+        return;
+    }
+    const hsize_t one = 1;
+    const uint64_t dummy = 0;
+    hid_t memspace = H5Screate_simple(1, &one, NULL);
+    H5Sselect_none(memspace);
+    H5Sselect_none(dspace);
+    H5Dwrite(ds, dtype, memspace, dspace, plist, &dummy);
+    H5Sclose(memspace);
 }
 
 
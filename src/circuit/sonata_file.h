@@ -7,14 +7,20 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <hdf5.h>
 #include <highfive/H5File.hpp>
 #include <mpi.h>
 
+#include "index/index.h"
+
 namespace neuron_parquet {
 namespace circuit {
 
@@ -23,14 +29,89 @@ class SonataFile {
 public:
     class Dataset;
 
-    SonataFile(const std::string& filepath, const std::string& population_name, uint64_t n_records=0);
+    /**
+     * \brief Creation properties for the datasets of the population.
+     *
+     * Datasets are contiguous by default.  Requesting a chunk size or any filter
+     * switches to a chunked layout; without an explicit chunk size, the chunk size is
+     * derived from \c block_size, the number of rows typically written at once.
+     */
+    struct DatasetLayout {
+        enum class Compression { None, Deflate, Szip };
+
+        uint64_t chunk_size = 0;
+        uint64_t block_size = 0;
+        Compression compression = Compression::None;
+        unsigned compression_level = 4;
+        bool shuffle = false;
+        bool checksum = false;
+        /// Bytes of consecutive rows collected before writing, 0 to write blocks as they come
+        uint64_t staging_size = 0;
+
+        inline bool filtered() const {
+            return compression != Compression::None || shuffle || checksum;
+        }
+
+        inline bool chunked() const {
+            return chunk_size > 0 || filtered();
+        }
+    };
+
+    /**
+     * \brief File creation and access settings.
+     *
+     * The default keeps the HDF5 defaults.  Zero values leave the respective
+     * setting untouched.  The settings used are stored as attributes of the root
+     * group.
+     */
+    struct FileTuning {
+        std::string profile = "default";
+        /// Align file objects of at least \c alignment_threshold bytes to \c alignment
+        hsize_t alignment = 0;
+        hsize_t alignment_threshold = 0;
+        /// Pre-fill datasets with fill values
+        bool fill_values = true;
+        /// Allocate the space of datasets when creating them
+        bool early_allocation = false;
+        /// Minimum size of metadata aggregation blocks
+        hsize_t metadata_block_size = 0;
+        /// Enables paged file-space aggregation with the given page size
+        hsize_t page_size = 0;
+
+        /// Settings for a Lustre file system with stripes of \a stripe_size bytes
+        static FileTuning lustre(hsize_t stripe_size);
+    };
+
+    /**
+     * With \a append, the population of an existing file is opened and its datasets
+     * are extended by \a n_records rows: create_dataset() opens the existing datasets,
+     * which have to be chunked to be extended, and create_library() adds new values
+     * to the existing libraries.
+     */
+    SonataFile(const std::string& filepath, const std::string& population_name, uint64_t n_records=0,
+               const DatasetLayout& layout = {}, const FileTuning& tuning = {}, bool append = false);
     SonataFile(const std::string& filepath, const std::string& population_name,
-                    const MPI_Comm& mpicomm, const MPI_Info& mpiinfo, uint64_t n_records=0);
+                    const MPI_Comm& mpicomm, const MPI_Info& mpiinfo, uint64_t n_records=0,
+                    const DatasetLayout& layout = {}, const FileTuning& tuning = {}, bool append = false);
 
     SonataFile(SonataFile&&) = default;
     ~SonataFile() = default;
 
-    void write_indices(size_t source_size, size_t target_size, bool parallel=false);
+    /// Number of HDF5 writes by size, bucket \c i counting writes of [2^i, 2^(i+1)) bytes
+    using WriteSizes = std::array<uint64_t, 64>;
+
+    indexing::Summary write_indices(size_t source_size, size_t target_size, bool parallel=false,
+                                    const indexing::Options& options = {});
+    /// Writes the indices from the ranges of edges written by this rank, see indexing::write
+    indexing::Summary write_indices(size_t source_size, size_t target_size,
+                                    indexing::FlatRawIndex source_ranges, indexing::FlatRawIndex target_ranges,
+                                    const indexing::Options& options = {});
+
+    /// Writes the data staged by all datasets
+    void flush();
+
+    /// The sizes of the writes to all datasets so far
+    WriteSizes write_sizes() const;
 
     void create_attribute(const std::string& name, const std::string& value);
     void create_dataset_attribute(const std::string& dataset, const std::string& name, const std::string& value);
@@ -40,8 +121,29 @@ public:
     /**
      * \brief Creates a library dataset under \c @library named \a name, with \a data as
      * contents.
+     *
+     * In parallel mode, all metadata operations are collective: all ranks have to create
+     * the same datasets, attributes and libraries in the same order.
+     *
+     * When appending to an existing library, the values of \a data that it lacks are
+     * added after the existing ones.  Returns the values stored.
      */
-    void create_library(const std::string& name, const std::vector<std::string>& data);
+    std::vector<std::string> create_library(const std::string& name, const std::vector<std::string>& data);
+
+    /// Values of the existing library \a name when appending, empty otherwise
+    std::vector<std::string> existing_library(const std::string& name);
+
+    /// Rows of the population before appending, 0 for a new file
+    inline uint64_t existing_records() const {
+        return existing_records_;
+    }
+
+    /// Throws if an existing dataset has not been opened by create_dataset() when appending
+    void check_appended() const;
+
+    /// Extends the datasets opened by create_dataset() to hold the appended rows.  Called
+    /// once the input is known to match, so that a rejected input leaves the file alone.
+    void extend_appended();
 
     inline const std::unordered_map<std::string, Dataset>& datasets() {
         return datasets_;
@@ -51,6 +153,13 @@ public:
         return datasets_.count(name) > 0;
     }
 
+    /// Whether datasets have to be written with collective transfers, as found from
+    /// their filters: when appending, these come from the file rather than the layout
+    inline bool collective() const {
+        return std::any_of(datasets_.begin(), datasets_.end(),
+                           [](const auto& dataset) { return dataset.second.collective(); });
+    }
+
     inline Dataset& operator[](const std::string& name) {
         return datasets_.at(name);
     }
@@ -58,15 +167,31 @@ public:
     /**
      * @brief The Dataset class
      *        A relativelly low-level wrapper to Hdf5 datasets, optimized for many small-chunk writing
-     *        The dataset is not resizable, but can be written in chunks given the buffer length and destination offset
+     *        The dataset is written in chunks given the buffer length and destination offset
+     *
+     *        Filtered datasets written in parallel have to use collective transfers: every
+     *        rank has to call write() the same number of times, using write_none() to
+     *        participate without data.
+     *
+     *        Otherwise, consecutive rows may be staged in a buffer of \a staging_size
+     *        bytes and written in blocks aligned to the buffer size, see flush().
+     *
+     *        Chunked datasets are created without a maximum size, so that later
+     *        conversions can append to them.
      */
     class Dataset {
     public:
         Dataset(hid_t h5_loc, const std::string& name, hid_t h5type, uint64_t length,
-                uint64_t width=1, bool parallel=false);
+                uint64_t width=1, bool parallel=false, hid_t dcpl=H5P_DEFAULT,
+                uint64_t staging_size=0);
         Dataset() {}
         ~Dataset();
 
+        /// Opens the existing dataset \a name, checks its type and that it can be extended
+        /// to \a length rows, see extend()
+        static Dataset open(hid_t h5_loc, const std::string& name, hid_t h5type, uint64_t width,
+                            uint64_t length, bool parallel=false, uint64_t staging_size=0);
+
         // no copies (we hold ids for h5 objects and must know when to destroy them)
         Dataset(const Dataset&) = delete;
         Dataset& operator=(const Dataset&) = delete;
@@ -74,17 +199,54 @@ public:
         Dataset& operator=(Dataset&&) = default;
         Dataset(Dataset&&) = default;
 
+        /// Writes \a length complete rows
         void write(const void* buffer,
                    const hsize_t length,
                    const hsize_t h5offset);
+        /// Writes \a length values of a single \a column
         void write(const void* buffer,
                    const hsize_t column,
                    const hsize_t length,
                    const hsize_t h5offset);
+        /// Extends a dataset opened to append to the length given to open(), false on failure
+        bool extend();
+        /// Takes part in a collective transfer without writing any data.
+        void write_none();
+        /// Writes the staged rows, if any
+        void flush();
+
+        inline bool collective() const {
+            return collective_;
+        }
+
+        /// The size of a row in bytes
+        inline size_t row_bytes() const {
+            return row_bytes_;
+        }
+
+        inline const WriteSizes& write_sizes() const {
+            return write_sizes_;
+        }
 
     protected:
+        /// Sets up the transfers to the dataset created with \a dcpl
+        void init_transfer(bool parallel, hid_t dcpl, uint64_t staging_size);
+
+        /// Writes \a length complete rows without staging
+        void write_rows(const void* buffer, hsize_t length, hsize_t offset);
+
         hid_t ds, plist, dspace, dtype;
         uint64_t width;
+        // Rows of a dataset opened to append to, once extended
+        hsize_t extent_ = 0;
+        bool collective_ = false;
+        size_t row_bytes_ = 0;
+        // Rows waiting to be written, starting at staged_offset_
+        std::vector<uint8_t> staging_;
+        hsize_t staging_rows_ = 0;
+        hsize_t staged_offset_ = 0;
+        hsize_t staged_rows_ = 0;
+        WriteSizes write_sizes_{};
         // Keep control after moves if this is a valid object
         // unique_ptr's work, they init as "false" and become "false" after moved.
         std::unique_ptr<bool> valid_;
@@ -94,11 +256,23 @@ public:
 protected:
     SonataFile() = delete;
 
+    /// Stores the file tuning as attributes of the root group
+    void write_tuning_attributes();
+
+    /// Determines the datasets and rows of the population to append to
+    void find_existing_datasets();
+
     bool parallel_mode_;
+    bool append_;
+    DatasetLayout layout_;
+    FileTuning tuning_;
     HighFive::File file_;
     HighFive::Group population_group_;
     HighFive::Group properties_group_;
     uint64_t n_records_;
+    uint64_t existing_records_ = 0;
+    // Existing datasets not opened yet when appending
+    std::unordered_set<std::string> unopened_;
     std::unordered_map<std::string, Dataset> datasets_;
 };
 
@@ -7,13 +7,19 @@
  */
 #include "sonata_writer.h"
 
+#include <algorithm>
+#include <cstring>
 #include <functional>
 #include <thread>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <unordered_set>
 
+#include <arrow/array/concatenate.h>
+#include <arrow/type_traits.h>
 #include <nlohmann/json.hpp>
+#include <parquet/arrow/schema.h>
 
 #include "version.h"
 
@@ -25,28 +31,44 @@ namespace circuit {
 using namespace arrow;
 using namespace std;
 
+static const uint8_t* raw_values(const Array& array);
 
-static const unordered_set<string> COLUMNS_TO_SKIP{"synapse_id", "__index_level_0__"};
+
+/// Whether the column \a name holds the node IDs indexed while writing
+static bool is_node_id_column(const std::string& name) {
+    return name == "source_node_id" || name == "target_node_id";
+}
 
 
 SonataWriter::SonataWriter(const string & filepath,
                                      uint64_t n_records,
-                                     const string& population_name)
-  : sonata_file_(filepath, population_name, n_records),
+                                     const string& population_name,
+                                     const SonataFile::DatasetLayout& layout,
+                                     const SonataFile::FileTuning& tuning,
+                                     const ColumnSelection& columns,
+                                     bool append)
+  : sonata_file_(filepath, population_name, n_records, layout, tuning, append),
+    columns_(columns),
     total_records_(n_records),
     population_name_(population_name),
-    output_file_offset_(0)
+    output_file_offset_(sonata_file_.existing_records())
 { }
 
 SonataWriter::SonataWriter(const string & filepath,
                                      uint64_t n_records,
                                      const MPI_Params& mpi_params,
                                      uint64_t output_offset,
-                                     const string& population_name)
-  : sonata_file_(filepath, population_name, mpi_params.comm, mpi_params.info, n_records),
+                                     const string& population_name,
+                                     const SonataFile::DatasetLayout& layout,
+                                     const SonataFile::FileTuning& tuning,
+                                     const ColumnSelection& columns,
+                                     bool append)
+  : sonata_file_(filepath, population_name, mpi_params.comm, mpi_params.info, n_records, layout, tuning, append),
+    columns_(columns),
+    comm_(mpi_params.comm),
     total_records_(n_records),
     population_name_(population_name),
-    output_file_offset_(output_offset)
+    output_file_offset_(sonata_file_.existing_records() + output_offset)
 { }
 
 
@@ -77,32 +99,201 @@ void throw_invalid_column(const std::string& col_name,
 }
 
 
-void SonataWriter::setup(const CircuitData::Schema* schema, std::shared_ptr<const CircuitData::Metadata> metadata) {
+void SonataWriter::add_library(const std::string& name, const std::vector<std::string>& values) {
+    Library library;
+    StringBuilder builder;
+    for (size_t i = 0; i < values.size(); ++i) {
+        library.positions[values[i]] = static_cast<int32_t>(i);
+        const auto status = builder.Append(values[i]);
+        if (!status.ok()) {
+            throw std::runtime_error(status.ToString());
+        }
+    }
+    const auto status = builder.Finish(&library.dictionary);
+    if (!status.ok()) {
+        throw std::runtime_error(status.ToString());
+    }
+    libraries_[name] = std::move(library);
+    library_values_[name] = values;
+}
+
+
+void SonataWriter::sort_by(const std::vector<std::string>& columns) {
+    if (columns.empty() || columns.size() > 2) {
+        throw std::runtime_error("sorting requires one or two columns");
+    }
+    sort_by_ = columns;
+}
+
+
+/// Describes the nested column \a field: the type and number of values per row
+nlohmann::json describe_nested(const Field& field) {
+    nlohmann::json col{{"name", field.name()}, {"width", 0}};
+    const auto& type = *field.type();
+    if (type.id() == Type::FIXED_SIZE_LIST) {
+        const auto& list = static_cast<const FixedSizeListType&>(type);
+        col["width"] = list.list_size();
+        col["value_type"] = list.value_type()->id();
+    } else if (type.id() == Type::STRUCT && type.num_fields() > 0) {
+        // All fields need the same type to form the columns of one dataset
+        const auto value_type = type.field(0)->type()->id();
+        for (const auto& child: type.fields()) {
+            if (child->type()->id() != value_type) {
+                return col;
+            }
+        }
+        col["width"] = type.num_fields();
+        col["value_type"] = value_type;
+    }
+    return col;
+}
+
+
+/// Describes the columns and key-value metadata of the input
+nlohmann::json describe_input(const CircuitData::Schema* schema,
+                              const std::shared_ptr<const CircuitData::Metadata>& metadata) {
+    // Nested columns are described by their Arrow type, which may be stored
+    // in the metadata (e.g. fixed size lists)
+    std::shared_ptr<Schema> arrow_schema;
+    const auto status = parquet::arrow::FromParquetSchema(
+        schema, parquet::default_arrow_reader_properties(), metadata, &arrow_schema);
+    if (!status.ok()) {
+        throw std::runtime_error(status.ToString());
+    }
+
+    nlohmann::json description;
+    description["columns"] = nlohmann::json::array();
     for (int i = 0; i < schema->num_columns(); ++i) {
         const auto& col = schema->Column(i);
-        const auto col_name = col->name();
-        if (COLUMNS_TO_SKIP.count(col_name) > 0) {
+        const auto root = schema->GetColumnRoot(i);
+        if (root->is_primitive()) {
+            description["columns"].push_back({
+                {"name", col->name()},
+                {"physical_type", col->physical_type()},
+                {"converted_type", col->converted_type()}
+            });
+        } else if (i == 0 || schema->GetColumnRoot(i - 1) != root) {
+            const auto field = arrow_schema->GetFieldByName(root->name());
+            if (!field) {
+                throw std::runtime_error("column " + root->name() + " missing from the Arrow schema");
+            }
+            description["columns"].push_back(describe_nested(*field));
+        }
+    }
+
+    std::unordered_map<std::string, std::string> kv;
+    if (metadata) {
+        metadata->ToUnorderedMap(&kv);
+    }
+    description["metadata"] = kv;
+    return description;
+}
+
+
+/// Replaces \a description with the one of rank 0 on all ranks of \a comm
+nlohmann::json broadcast_description(const nlohmann::json& description, MPI_Comm comm) {
+    std::string serialized = description.dump();
+    uint64_t size = serialized.size();
+    MPI_Bcast(&size, 1, MPI_UINT64_T, 0, comm);
+    serialized.resize(size);
+    MPI_Bcast(serialized.data(), size, MPI_CHAR, 0, comm);
+    return nlohmann::json::parse(serialized);
+}
+
+
+void SonataWriter::setup(const CircuitData::Schema* schema, std::shared_ptr<const CircuitData::Metadata> metadata) {
+    // All HDF5 metadata operations are collective: use the description of the
+    // first rank everywhere, so that all ranks create the same objects in the
+    // same order.
+    int rank = 0;
+    if (comm_ != MPI_COMM_NULL) {
+        MPI_Comm_rank(comm_, &rank);
+    }
+    nlohmann::json description;
+    if (rank == 0) {
+        description = describe_input(schema, metadata);
+    }
+    if (comm_ != MPI_COMM_NULL) {
+        description = broadcast_description(description, comm_);
+    }
+
+    std::unordered_set<std::string> available;
+    for (const auto& col: description["columns"]) {
+        available.insert(col["name"].get<std::string>());
+    }
+    for (const auto* names: {&columns_.include, &columns_.exclude}) {
+        for (const auto& name: *names) {
+            if (available.count(name) == 0) {
+                throw std::runtime_error("selected column " + name + " not found in the input");
+            }
+        }
+    }
+
+    for (const auto& col: description["columns"]) {
+        const std::string col_name = col["name"];
+        if (!columns_.selected(col_name)) {
             continue;
         }
 
-        const auto col_type = parquet_types_to_h5(col->physical_type(), col->converted_type());
+        hid_t col_type = -1;
+        uint64_t width = 1;
+        if (col.contains("width")) {
+            // Fixed size lists and structs are stored as 2D datasets
+            width = col["width"].get<uint64_t>();
+            if (width > 0) {
+                col_type = arrow_types_to_h5(col["value_type"].get<Type::type>());
+            }
+        } else {
+            const auto physical_type = col["physical_type"].get<parquet::Type::type>();
+            col_type = parquet_types_to_h5(physical_type, col["converted_type"].get<parquet::ConvertedType::type>());
+            if (physical_type == parquet::Type::BYTE_ARRAY && libraries_.count(col_name) > 0) {
+                // Written as indices into the library
+                col_type = H5T_STD_I32LE;
+            }
+        }
         if (col_type < 0) {
             throw std::runtime_error("column " + col_name + " cannot be converted");
         }
         if (!sonata_file_.has_dataset(col_name)) {
-            sonata_file_.create_dataset(col_name, col_type, 0, 1);
+            sonata_file_.create_dataset(col_name, col_type, 0, width);
+            dataset_order_.push_back(col_name);
+        }
+    }
+    if (dataset_order_.empty()) {
+        throw std::runtime_error("no columns selected for conversion");
+    }
+    for (const auto& name: sort_by_) {
+        if (!sonata_file_.has_dataset(name)) {
+            throw std::runtime_error("cannot sort by column " + name + ", not converted");
         }
     }
+    sonata_file_.check_appended();
 
-    std::unordered_map<std::string, std::string> kv;
-    metadata->ToUnorderedMap(&kv);
+    // When appending, the indices refer to the existing values followed by new ones
+    std::map<std::string, std::vector<std::string>> stored_values;
+    for (const auto& [name, values]: library_values_) {
+        if (sonata_file_.has_dataset(name)) {
+            stored_values[name] = sonata_file_.create_library(name, values);
+        }
+    }
+    for (const auto& [name, values]: stored_values) {
+        if (values != library_values_[name]) {
+            add_library(name, values);
+        }
+    }
+
+    const std::map<std::string, std::string> kv = description["metadata"];
     for (const auto& p: kv) {
         if (p.first == "ARROW:schema") {
             // ignore arrow metadata
         } else if (p.first == "source_population_name") {
-            sonata_file_.create_dataset_attribute("source_node_id", "node_population", p.second);
+            if (sonata_file_.has_dataset("source_node_id")) {
+                sonata_file_.create_dataset_attribute("source_node_id", "node_population", p.second);
+            }
         } else if (p.first == "target_population_name") {
-            sonata_file_.create_dataset_attribute("target_node_id", "node_population", p.second);
+            if (sonata_file_.has_dataset("target_node_id")) {
+                sonata_file_.create_dataset_attribute("target_node_id", "node_population", p.second);
+            }
         } else if (p.first == "source_population_size") {
             source_size_ = std::stoul(p.second);
         } else if (p.first == "target_population_size") {
@@ -111,9 +302,17 @@ void SonataWriter::setup(const CircuitData::Schema* schema, std::shared_ptr<cons
             auto j = nlohmann::json::parse(p.second);
             for (const auto& field: j["fields"]) {
                 const auto metadata = field["metadata"];
-                const auto name = field["name"];
-                if (metadata.contains("enumeration_values")) {
+                const std::string name = field["name"];
+                if (metadata.contains("enumeration_values") && columns_.selected(name) &&
+                    library_values_.count(name) == 0) {
                     std::vector<std::string> enum_values = metadata["enumeration_values"];
+                    // The column holds positions into the enumeration, which has to be
+                    // the existing library.  Checked before anything is written.
+                    const auto existing = sonata_file_.existing_library(name);
+                    if (!existing.empty() && existing != enum_values) {
+                        throw std::runtime_error("cannot append, the enumeration values of " + name +
+                                                 " differ from the existing library");
+                    }
                     sonata_file_.create_library(name, enum_values);
                 }
             }
@@ -126,6 +325,7 @@ void SonataWriter::setup(const CircuitData::Schema* schema, std::shared_ptr<cons
         }
     }
     sonata_file_.create_attribute("parquet2hdf5_version", neuron_parquet::VERSION);
+    sonata_file_.extend_appended();
 }
 
 
@@ -140,19 +340,62 @@ void SonataWriter::write(const CircuitData * data, uint length) {
     }
 
     shared_ptr<Table> row_group(data->row_group);
-    int n_cols = row_group->num_columns();
-    auto names = row_group->ColumnNames();
 
-    for(int i=0; i<n_cols; i++) {
-        auto col = row_group->column(i);
-        if (COLUMNS_TO_SKIP.count(names[i]) > 0) {
+    if (!sort_by_.empty()) {
+        // Written once all rows are known, see flush()
+        pending_.push_back(row_group);
+        output_file_offset_ += row_group->num_rows();
+        return;
+    }
+
+    // Follow the dataset order rather than the column order, collective
+    // transfers have to be issued in the same sequence on all ranks
+    for (const auto& name: dataset_order_) {
+        auto col = row_group->GetColumnByName(name);
+        if (!col) {
             continue;
         }
-        write_data(sonata_file_[names[i]], output_file_offset_, col);
+        const auto library = libraries_.find(name);
+        write_data(sonata_file_[name], output_file_offset_, col,
+                   library != libraries_.end() ? &library->second : nullptr);
+        // Only the node IDs are integers with a values buffer, nested columns have none
+        if (collect_ranges_ && is_node_id_column(name)) {
+            uint64_t offset = output_file_offset_;
+            for (const auto& chunk: col->chunks()) {
+                if (!is_integer(chunk->type_id())) {
+                    throw std::runtime_error("unsupported type for node IDs in " + name);
+                }
+                const auto& type = static_cast<const FixedWidthType&>(*chunk->type());
+                collect_node_ids(name, raw_values(*chunk), type.bit_width() / 8, chunk->length(), offset);
+                offset += chunk->length();
+            }
+        }
+    }
+
+    // Columns of the same rows may arrive in several blocks
+    if (data->complete) {
+        output_file_offset_ += row_group->num_rows();
+        ++write_rounds_;
     }
+}
+
 
-    output_file_offset_ += row_group->num_rows();
+void SonataWriter::flush() {
+    if (!sort_by_.empty()) {
+        write_sorted();
+    }
+    sonata_file_.flush();
+    if (comm_ == MPI_COMM_NULL || !sonata_file_.collective()) {
+        return;
+    }
 
+    uint64_t rounds;
+    MPI_Allreduce(&write_rounds_, &rounds, 1, MPI_UINT64_T, MPI_MAX, comm_);
+    for (; write_rounds_ < rounds; ++write_rounds_) {
+        for (const auto& name: dataset_order_) {
+            sonata_file_[name].write_none();
+        }
+    }
 }
 
 
@@ -194,27 +437,274 @@ inline hid_t parquet_types_to_h5(parquet::Type::type t, parquet::ConvertedType::
 }
 
 
+inline hid_t arrow_types_to_h5(Type::type t) {
+    switch (t) {
+        case Type::UINT8:
+            return H5T_STD_U8LE;
+        case Type::UINT16:
+            return H5T_STD_U16LE;
+        case Type::UINT32:
+            return H5T_STD_U32LE;
+        case Type::UINT64:
+            return H5T_STD_U64LE;
+        case Type::INT8:
+            return H5T_STD_I8LE;
+        case Type::INT16:
+            return H5T_STD_I16LE;
+        case Type::INT32:
+            return H5T_STD_I32LE;
+        case Type::INT64:
+            return H5T_STD_I64LE;
+        case Type::FLOAT:
+            return H5T_IEEE_F32LE;
+        case Type::DOUBLE:
+            return H5T_IEEE_F64LE;
+        default:
+            break;
+    }
+    std::cerr << "attempt to convert an unknown datatype!" << std::endl;
+    return -1;
+}
+
+
 // ================================================================================================
 
+/// Returns the first value of a primitive array, which may be a slice of a larger one
+static const uint8_t* raw_values(const Array& array) {
+    const auto& type = static_cast<const FixedWidthType&>(*array.type());
+    const auto& buffer = static_cast<const PrimitiveArray&>(array).values();
+    return buffer->data() + array.offset() * type.bit_width() / 8;
+}
+
+/// Maps the dictionary indices of \a chunk to indices into the \a library
+static shared_ptr<Array> library_indices(const Array& chunk, const shared_ptr<Array>& library,
+                                         const unordered_map<string, int32_t>& positions) {
+    if (chunk.type_id() != Type::DICTIONARY) {
+        throw std::runtime_error("expected dictionary encoded strings");
+    }
+    const auto& encoded = static_cast<const DictionaryArray&>(chunk);
+    const auto& dictionary = static_cast<const StringArray&>(*encoded.dictionary());
+    // Only the (small) dictionary is looked up, the indices are remapped in bulk
+    std::vector<int32_t> transpose(dictionary.length());
+    for (int64_t i = 0; i < dictionary.length(); ++i) {
+        const auto it = positions.find(dictionary.GetString(i));
+        if (it == positions.end()) {
+            throw std::runtime_error("value missing from library: " + dictionary.GetString(i));
+        }
+        transpose[i] = it->second;
+    }
+    auto result = encoded.Transpose(arrow::dictionary(int32(), utf8()), library, transpose.data());
+    if (!result.ok()) {
+        throw std::runtime_error(result.status().ToString());
+    }
+    return static_cast<const DictionaryArray&>(**result).indices();
+}
+
+/// Returns the first value of a fixed size list array, stored as consecutive rows
+static const uint8_t* list_values(const FixedSizeListArray& array) {
+    const auto& type = static_cast<const FixedWidthType&>(*array.value_type());
+    return raw_values(*array.values()) + array.value_offset(0) * type.bit_width() / 8;
+}
+
+/// Copies the fields of \a array into consecutive rows at \a rows
+static void interleave_fields(const StructArray& array, uint8_t* rows) {
+    const int width = array.num_fields();
+    const auto& type = static_cast<const FixedWidthType&>(*array.field(0)->type());
+    const size_t value_size = type.bit_width() / 8;
+    for (int i = 0; i < width; ++i) {
+        const uint8_t* values = raw_values(*array.field(i));
+        for (int64_t row = 0; row < array.length(); ++row) {
+            std::copy_n(values + row * value_size, value_size,
+                        rows + (row * width + i) * value_size);
+        }
+    }
+}
+
+/// Writes one chunk of a fixed size list or struct column into the rows of \a dataset
+static void write_nested(SonataFile::Dataset& dataset, uint64_t offset, const Array& chunk) {
+    if (chunk.type_id() == Type::FIXED_SIZE_LIST) {
+        // The values of all rows are consecutive, a single write without copies
+        dataset.write(list_values(static_cast<const FixedSizeListArray&>(chunk)), chunk.length(), offset);
+        return;
+    }
+
+    const auto& array = static_cast<const StructArray&>(chunk);
+    if (!dataset.collective()) {
+        // Every field is written straight from its buffer
+        for (int i = 0; i < array.num_fields(); ++i) {
+            dataset.write(raw_values(*array.field(i)), i, chunk.length(), offset);
+        }
+        return;
+    }
+
+    // Collective transfers require exactly one write per block: interleave the fields
+    std::vector<uint8_t> rows(chunk.length() * dataset.row_bytes());
+    interleave_fields(array, rows.data());
+    dataset.write(rows.data(), chunk.length(), offset);
+}
+
+/// Appends the rows of \a chunk, of \a row_bytes bytes each, to \a rows
+static void append_rows(std::vector<uint8_t>& rows, size_t row_bytes, const Array& chunk) {
+    const size_t size = rows.size();
+    rows.resize(size + chunk.length() * row_bytes);
+    if (chunk.type_id() == Type::STRUCT) {
+        interleave_fields(static_cast<const StructArray&>(chunk), rows.data() + size);
+        return;
+    }
+    const uint8_t* values = chunk.type_id() == Type::FIXED_SIZE_LIST
+                          ? list_values(static_cast<const FixedSizeListArray&>(chunk))
+                          : raw_values(chunk);
+    std::copy_n(values, chunk.length() * row_bytes, rows.data() + size);
+}
+
+/// Appends the node IDs of \a column to \a ids
+static void append_node_ids(std::vector<uint64_t>& ids, const ChunkedArray& column) {
+    for (const auto& chunk: column.chunks()) {
+        switch (chunk->type_id()) {
+            case Type::INT32:
+                for (int64_t i = 0; i < chunk->length(); ++i)
+                    ids.push_back(static_cast<const Int32Array&>(*chunk).Value(i));
+                break;
+            case Type::UINT32:
+                for (int64_t i = 0; i < chunk->length(); ++i)
+                    ids.push_back(static_cast<const UInt32Array&>(*chunk).Value(i));
+                break;
+            case Type::INT64:
+                for (int64_t i = 0; i < chunk->length(); ++i)
+                    ids.push_back(static_cast<const Int64Array&>(*chunk).Value(i));
+                break;
+            case Type::UINT64:
+                for (int64_t i = 0; i < chunk->length(); ++i)
+                    ids.push_back(static_cast<const UInt64Array&>(*chunk).Value(i));
+                break;
+            default:
+                throw std::runtime_error("can only sort by integer columns");
+        }
+    }
+}
+
+void SonataWriter::collect_node_ids(const std::string& name, const uint8_t* values, size_t value_bytes,
+                                    uint64_t count, uint64_t offset) {
+    indexing::RangeCollector* ranges = nullptr;
+    if (name == "source_node_id") {
+        ranges = &source_ranges_;
+    } else if (name == "target_node_id") {
+        ranges = &target_ranges_;
+    } else {
+        return;
+    }
+    if (value_bytes != sizeof(uint64_t) && value_bytes != sizeof(uint32_t)) {
+        throw std::runtime_error("unsupported type for node IDs in " + name);
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t id = 0;
+        if (value_bytes == sizeof(uint64_t)) {
+            std::memcpy(&id, values + i * value_bytes, sizeof(uint64_t));
+        } else {
+            uint32_t small_id;
+            std::memcpy(&small_id, values + i * value_bytes, sizeof(uint32_t));
+            id = small_id;
+        }
+        ranges->add(id, offset + i);
+    }
+}
+
+void SonataWriter::write_sorted() {
+    uint64_t rows = 0;
+    for (const auto& table: pending_) {
+        rows += table->num_rows();
+    }
+
+    // Ties are resolved by the position in the input, the rows of this rank
+    // follow the ones of all lower ranks
+    std::vector<SortKey> keys(rows);
+    {
+        std::vector<uint64_t> primary, secondary;
+        for (const auto& table: pending_) {
+            append_node_ids(primary, *table->GetColumnByName(sort_by_[0]));
+            if (sort_by_.size() > 1) {
+                append_node_ids(secondary, *table->GetColumnByName(sort_by_[1]));
+            }
+        }
+        const uint64_t first = output_file_offset_ - rows;
+        for (uint64_t i = 0; i < rows; ++i) {
+            keys[i] = {primary[i], secondary.empty() ? 0 : secondary[i], first + i};
+        }
+    }
+
+    std::vector<EdgeColumn> columns;
+    for (const auto& name: dataset_order_) {
+        EdgeColumn column{sonata_file_[name].row_bytes(), {}};
+        column.data.reserve(rows * column.row_bytes);
+        const auto library = libraries_.find(name);
+        for (const auto& table: pending_) {
+            for (auto chunk: table->GetColumnByName(name)->chunks()) {
+                if (library != libraries_.end()) {
+                    chunk = library_indices(*chunk, library->second.dictionary, library->second.positions);
+                }
+                append_rows(column.data, column.row_bytes, *chunk);
+            }
+        }
+        columns.push_back(std::move(column));
+    }
+    pending_.clear();
+
+    // Appended rows are sorted among themselves, after the existing ones
+    const uint64_t offset = sonata_file_.existing_records() + sort_edges(comm_, keys, columns);
+
+    // Every rank writes each dataset exactly once, also without rows
+    for (size_t i = 0; i < dataset_order_.size(); ++i) {
+        sonata_file_[dataset_order_[i]].write(columns[i].data.data(), keys.size(), offset);
+        if (collect_ranges_) {
+            collect_node_ids(dataset_order_[i], columns[i].data.data(), columns[i].row_bytes, keys.size(), offset);
+        }
+        columns[i].data = {};
+    }
+    write_rounds_ = 1;
+}
+
 void SonataWriter::write_data(SonataFile::Dataset& dataset,
                               uint64_t offset,
-                              const shared_ptr<const ChunkedArray>& col_data) {
+                              const shared_ptr<const ChunkedArray>& col_data,
+                              const Library* library) {
 
     #ifdef NEURON_LOGGING
     cerr << "Writing data... " <<  col_data->length() << " records." << endl;
     #endif
 
-    if (col_data->type()->id() != Type::STRUCT) {
-        // get chunks and retrieve the raw data from the buffer
-        for (const shared_ptr<Array> & chunk : col_data->chunks()) {
-            auto buffer = static_cast<PrimitiveArray*>(chunk.get())->values();
-            dataset.write(buffer->data(), chunk->length(), offset);
-            offset += chunk->length();
-        }
-    } else {
+    const auto type_id = col_data->type()->id();
+    const bool nested = type_id == Type::FIXED_SIZE_LIST || type_id == Type::STRUCT;
+    if (!nested && !is_primitive(type_id) && !library) {
         std::cerr << "ERROR: unsupported column type" << std::endl;
         throw std::runtime_error("Unsupported dataset");
     }
+
+    ArrayVector chunks = col_data->chunks();
+    if (library) {
+        for (auto& chunk: chunks) {
+            chunk = library_indices(*chunk, library->dictionary, library->positions);
+        }
+    }
+    if (dataset.collective() && chunks.empty()) {
+        dataset.write_none();
+        return;
+    } else if (dataset.collective() && chunks.size() > 1) {
+        // Collective transfers require exactly one write per block
+        auto result = Concatenate(chunks, default_memory_pool());
+        if (!result.ok()) {
+            throw std::runtime_error(result.status().ToString());
+        }
+        chunks = {*result};
+    }
+    // get chunks and retrieve the raw data from the buffer
+    for (const shared_ptr<Array> & chunk : chunks) {
+        if (nested) {
+            write_nested(dataset, offset, *chunk);
+        } else {
+            dataset.write(raw_values(*chunk), chunk->length(), offset);
+        }
+        offset += chunk->length();
+    }
 }
 
 
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <map>
 #include <string>
 #include <unordered_map>
 #include <memory>
@@ -18,6 +19,7 @@
 
 #include "../generic_writer.h"
 #include "circuit_defs.h"
+#include "edge_sort.h"
 #include "sonata_file.h"
 
 
@@ -40,32 +42,120 @@ public:
         MPI_Info info;
     };
 
+    /**
+     * With \a append, the \a n_records rows are appended to the existing population
+     * \a population_name of \a filepath, see SonataFile.
+     */
     SonataWriter(const std::string& filepath,
                       uint64_t n_records,
-                      const std::string& population_name);
+                      const std::string& population_name,
+                      const SonataFile::DatasetLayout& layout = {},
+                      const SonataFile::FileTuning& tuning = {},
+                      const ColumnSelection& columns = {},
+                      bool append = false);
 
     SonataWriter(const std::string& filepath,
                       uint64_t n_records,
                       const MPI_Params& mpi_params,
                       uint64_t output_offset,
-                      const std::string& population_name);
+                      const std::string& population_name,
+                      const SonataFile::DatasetLayout& layout = {},
+                      const SonataFile::FileTuning& tuning = {},
+                      const ColumnSelection& columns = {},
+                      bool append = false);
 
     ~SonataWriter() = default;
 
+    /**
+     * \brief Registers the distinct values of the string column \a name.
+     *
+     * Has to be called before setup() with the same values on all ranks. The
+     * column is written as indices into \a values, which are stored as the
+     * `@library` of the column.
+     */
+    void add_library(const std::string& name, const std::vector<std::string>& values);
+
+    /**
+     * \brief Sorts the output by the node ID \a columns, e.g. target and source.
+     *
+     * Has to be called before setup().  All rows are kept in memory and
+     * distributed between the ranks by flush(), so that every node ID forms a
+     * single contiguous range in the output.
+     */
+    void sort_by(const std::vector<std::string>& columns);
+
     virtual void setup(const CircuitData::Schema* schema, std::shared_ptr<const CircuitData::Metadata> metdata) override;
 
     virtual void write(const CircuitData* data, uint length) override;
 
-    void write_indices(bool parallel = false) {
-        sonata_file_.write_indices(source_size_, target_size_, parallel);
+    /**
+     * \brief Completes all outstanding writes.
+     *
+     * Has to be called by all ranks after the last call to write(): rows kept
+     * for sorting are sorted and written, staged rows are written and, with
+     * collective transfers, ranks that wrote fewer blocks than others take part
+     * in the remaining transfers without data.
+     */
+    void flush();
+
+    /// The sizes of the writes to the datasets so far
+    SonataFile::WriteSizes write_sizes() const {
+        return sonata_file_.write_sizes();
+    }
+
+    /**
+     * \brief Groups the node IDs into index ranges while they are written.
+     *
+     * Has to be called before the first call to write(), allows write_indices()
+     * to skip reading the node IDs back.
+     */
+    void collect_index_ranges() {
+        collect_ranges_ = true;
+    }
+
+    indexing::Summary write_indices(bool parallel = false, const indexing::Options& options = {}) {
+        if (collect_ranges_) {
+            return sonata_file_.write_indices(source_size_, target_size_,
+                                              source_ranges_.release(), target_ranges_.release(), options);
+        }
+        return sonata_file_.write_indices(source_size_, target_size_, parallel, options);
     }
 
 private:
+    /// The values of an enumeration and their positions
+    struct Library {
+        std::shared_ptr<arrow::Array> dictionary;
+        std::unordered_map<std::string, int32_t> positions;
+    };
+
+    /// Sorts the rows kept by write() across all ranks and writes them
+    void write_sorted();
+
+    /// Adds \a count node IDs of \a value_bytes bytes each to the ranges of column \a name
+    void collect_node_ids(const std::string& name, const uint8_t* values, size_t value_bytes,
+                          uint64_t count, uint64_t offset);
+
     static void write_data(SonataFile::Dataset& ds,
                            uint64_t r_offset,
-                           const std::shared_ptr<const arrow::ChunkedArray>& r_col_data);
+                           const std::shared_ptr<const arrow::ChunkedArray>& r_col_data,
+                           const Library* library = nullptr);
 
     SonataFile sonata_file_;
+    const ColumnSelection columns_;
+    MPI_Comm comm_ = MPI_COMM_NULL;
+    // Datasets in schema order, the same on all ranks
+    std::vector<std::string> dataset_order_;
+    // String columns written as enumerations
+    std::map<std::string, Library> libraries_;
+    std::map<std::string, std::vector<std::string>> library_values_;
+    uint64_t write_rounds_ = 0;
+    // Node ID columns to sort by and the blocks to sort
+    std::vector<std::string> sort_by_;
+    std::vector<std::shared_ptr<arrow::Table>> pending_;
+    // Index ranges of the edges written by this rank
+    bool collect_ranges_ = false;
+    indexing::RangeCollector source_ranges_;
+    indexing::RangeCollector target_ranges_;
 
     const uint64_t total_records_;
     const std::string population_name_;
@@ -83,5 +173,8 @@ private:
 /// plain `Type` for generic integer and floating point numbers.
 inline hid_t parquet_types_to_h5(parquet::Type::type, parquet::ConvertedType::type);
 
+/// \brief Map from the Arrow value types of nested columns to HDF5 ones
+inline hid_t arrow_types_to_h5(arrow::Type::type);
+
 
 }}  // namespace neuron_parquet::circuit EOF
@@ -42,7 +42,7 @@ class Converter {
         , reader_(reader)
         , writer_(writer)
         , n_records_(reader_.record_count())
-        , progress_handler_([](){})
+        , progress_handler_([](const T&, uint32_t){})
     {
         if (reader_.is_chunked()) {
             // Buffer is a single chunk
@@ -84,12 +84,12 @@ class Converter {
         for (int i = 0; i < n_buffers; i++) {
             reader_.fillBuffer(buffer_, BUFFER_LEN);
             writer_.write(buffer_, BUFFER_LEN);
-            progress_handler_();
+            progress_handler_(*buffer_, BUFFER_LEN);
         }
         if (remaining > 0) {
             reader_.fillBuffer(buffer_, remaining);
             writer_.write(buffer_, remaining);
-            progress_handler_();
+            progress_handler_(*buffer_, remaining);
         }
         return n;
     }
@@ -106,7 +106,7 @@ class Converter {
 
         while ((n = reader_.fillBuffer(buffer_, BUFFER_LEN)) > 0) {
             writer_.write(buffer_, n);
-            progress_handler_();
+            progress_handler_(*buffer_, n);
         }
         return size;
     }
@@ -115,11 +115,19 @@ class Converter {
     // T shall have += operator overloaded
     template<class P>
     void setProgressHandler(P& progress, int factor = 1) {
-        progress_handler_ = [&progress, factor]() {
+        progress_handler_ = [&progress, factor](const T&, uint32_t) {
             progress += factor;
         };
     }
 
+    /// Advances \a progress by \a count(block, records) for every block, times \a factor
+    template<class P, class Count>
+    void setProgressHandler(P& progress, int factor, Count count) {
+        progress_handler_ = [&progress, factor, count](const T& block, uint32_t records) {
+            progress += factor * count(block, records);
+        };
+    }
+
     /**
      *  \brief number_of_buffers Calculates the number of record buffers from the filesize, buffer len and record type
      *         NOTE: This function only makes sense for record buffers, not data chunks
@@ -139,7 +147,7 @@ class Converter {
     T* buffer_;
 
     const uint64_t n_records_;
-    std::function<void()> progress_handler_;
+    std::function<void(const T&, uint32_t)> progress_handler_;
 };
 
 
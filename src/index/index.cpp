@@ -1,9 +1,19 @@
 #include "index.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
 #include <set>
-#include <unordered_map>
+#include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <mpi.h>
@@ -15,9 +25,9 @@ namespace indexing {
 
 namespace {
 
-using NodeID = uint64_t;
+namespace fs = std::filesystem;
+
 using RawIndex = std::vector<std::array<uint64_t, 2>>;
-using FlatRawIndex = std::vector<std::array<uint64_t, 3>>;
 
 constexpr auto INDEX_ELEMENT_SIZE = sizeof(FlatRawIndex::value_type);
 
@@ -109,20 +119,47 @@ std::pair<uint64_t, uint64_t> partition_count(const uint64_t num, int rank = -1)
 }
 
 /**
- * \brief Takes a list of node IDs and groups them into ranges as a flat index.
+ * \brief Calls \a function with every index below \a count, on up to \a threads threads.
+ */
+template <typename Function>
+void _parallelFor(uint64_t count, unsigned threads, Function function) {
+    threads = std::min<uint64_t>(threads, count);
+    if (threads <= 1) {
+        for (uint64_t i = 0; i < count; ++i) {
+            function(i);
+        }
+        return;
+    }
+
+    std::atomic<uint64_t> next{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&next, count, &function]() {
+            for (uint64_t i = next++; i < count; i = next++) {
+                function(i);
+            }
+        });
+    }
+    for (auto& worker: workers) {
+        worker.join();
+    }
+}
+
+/**
+ * \brief Groups the node IDs in [\a begin, \a end) into ranges as a flat index.
  */
-FlatRawIndex _groupNodeRanges(const std::vector<NodeID>& nodeIDs, uint64_t offset) {
+FlatRawIndex _groupNodeRanges(const std::vector<NodeID>& nodeIDs, uint64_t begin, uint64_t end, uint64_t offset) {
     FlatRawIndex result;
 
-    if (nodeIDs.empty()) {
+    if (begin == end) {
         return result;
     }
 
-    result.reserve(nodeIDs.size());  // Worst-case scenario, avoid re-allocating a lot
+    result.reserve(end - begin);  // Worst-case scenario, avoid re-allocating a lot
 
-    uint64_t rangeStart = 0;
+    uint64_t rangeStart = begin;
     NodeID lastNodeID = nodeIDs[rangeStart];
-    for (uint64_t i = 1; i < nodeIDs.size(); ++i) {
+    for (uint64_t i = begin + 1; i < end; ++i) {
         if (nodeIDs[i] != lastNodeID) {
             result.push_back({lastNodeID, rangeStart + offset, i + offset});
             rangeStart = i;
@@ -130,28 +167,121 @@ FlatRawIndex _groupNodeRanges(const std::vector<NodeID>& nodeIDs, uint64_t offse
         }
     }
 
-    result.push_back({lastNodeID, rangeStart + offset, nodeIDs.size() + offset});
+    result.push_back({lastNodeID, rangeStart + offset, end + offset});
     result.shrink_to_fit();
 
     return result;
 }
 
 /**
- * \brief Takes a flat index and groups all ranges by node ID in a map.
+ * \brief Takes a list of node IDs and groups them into ranges as a flat index.
+ *
+ * Chunks of the node IDs are grouped on up to \a threads threads, joining the ranges
+ * of nodes that span two chunks.
  */
-std::unordered_map<NodeID, RawIndex> _regroupNodeRanges(const FlatRawIndex& nodeRanges) {
-    std::unordered_map<NodeID, RawIndex> result;
-    for (const auto& [id, start, end]: nodeRanges) {
-        auto& ranges = result[id];
-        if (!ranges.empty() && ranges.back()[0] <= start && start <= ranges.back()[1]) {
-            ranges.back()[1] = std::max(ranges.back()[1], end);
-        } else {
-            ranges.push_back({start, end});
+FlatRawIndex _groupNodeRanges(const std::vector<NodeID>& nodeIDs, uint64_t offset, unsigned threads = 1) {
+    const uint64_t chunks = std::clamp<uint64_t>(threads, 1, std::max<uint64_t>(1, nodeIDs.size()));
+    std::vector<FlatRawIndex> chunkRanges(chunks);
+    _parallelFor(chunks, threads, [&](uint64_t chunk) {
+        chunkRanges[chunk] = _groupNodeRanges(nodeIDs,
+                                              nodeIDs.size() * chunk / chunks,
+                                              nodeIDs.size() * (chunk + 1) / chunks,
+                                              offset);
+    });
+    if (chunks == 1) {
+        return std::move(chunkRanges.front());
+    }
+
+    uint64_t count = 0;
+    for (const auto& ranges: chunkRanges) {
+        count += ranges.size();
+    }
+    FlatRawIndex result;
+    result.reserve(count);
+    for (auto& ranges: chunkRanges) {
+        auto first = ranges.begin();
+        if (!result.empty() && first != ranges.end() && result.back()[0] == (*first)[0]) {
+            result.back()[2] = (*first)[2];
+            ++first;
         }
+        result.insert(result.end(), first, ranges.end());
+        ranges = FlatRawIndex();
     }
     return result;
 }
 
+/**
+ * \brief Merges the consecutive sorted runs of \a ranges delimited by \a offsets in place.
+ *
+ * The pairs of runs of every level are merged on up to \a threads threads.
+ */
+void _mergeSortedRuns(FlatRawIndex& ranges, std::vector<uint64_t> offsets, unsigned threads = 1) {
+    while (offsets.size() > 2) {
+        std::vector<uint64_t> merged{offsets.front()};
+        for (size_t i = 2; i < offsets.size(); i += 2) {
+            merged.push_back(offsets[i]);
+        }
+        _parallelFor((offsets.size() - 1) / 2, threads, [&ranges, &offsets](uint64_t pair) {
+            std::inplace_merge(ranges.begin() + offsets[2 * pair],
+                               ranges.begin() + offsets[2 * pair + 1],
+                               ranges.begin() + offsets[2 * pair + 2]);
+        });
+        if (offsets.size() % 2 == 0) {
+            // Odd number of runs, the last one is merged in the next pass
+            merged.push_back(offsets.back());
+        }
+        std::swap(offsets, merged);
+    }
+}
+
+/**
+ * \brief Sorts \a ranges by sorting chunks on up to \a threads threads and merging them.
+ */
+void _sortRanges(FlatRawIndex& ranges, unsigned threads) {
+    const uint64_t chunks = std::clamp<uint64_t>(threads, 1, std::max<uint64_t>(1, ranges.size()));
+    std::vector<uint64_t> offsets(chunks + 1);
+    for (uint64_t chunk = 0; chunk <= chunks; ++chunk) {
+        offsets[chunk] = ranges.size() * chunk / chunks;
+    }
+    _parallelFor(chunks, threads, [&ranges, &offsets](uint64_t chunk) {
+        std::sort(ranges.begin() + offsets[chunk], ranges.begin() + offsets[chunk + 1]);
+    });
+    _mergeSortedRuns(ranges, offsets, threads);
+}
+
+/**
+ * \brief Builds the node to ranges and ranges to edge IDs datasets in CSR form from
+ * ranges sorted by node ID, for the nodes starting at \a nodeOffset.
+ *
+ * Overlapping or adjacent ranges of a node are merged.  The range positions in the
+ * first dataset are local and have to be shifted by the ranges of lower ranks.
+ */
+std::pair<RawIndex, RawIndex> _buildIndex(const FlatRawIndex& sortedRanges,
+                                          uint64_t nodeOffset,
+                                          uint64_t nodeCount) {
+    RawIndex primary(nodeCount, {0, 0});
+    RawIndex secondary;
+    secondary.reserve(sortedRanges.size());
+
+    for (const auto& [id, start, end]: sortedRanges) {
+        if (id < nodeOffset || id >= nodeOffset + nodeCount) {
+            throw std::runtime_error("Received a node ID outside of the local partition");
+        }
+        auto& node = primary[id - nodeOffset];
+        if (node[1] > node[0] && start <= secondary.back()[1]) {
+            secondary.back()[1] = std::max(secondary.back()[1], end);
+        } else {
+            if (node[1] == node[0]) {
+                node[0] = secondary.size();
+            }
+            secondary.push_back({start, end});
+            node[1] = secondary.size();
+        }
+    }
+    secondary.shrink_to_fit();
+    return {primary, secondary};
+}
+
 /**
  * \brief Returns a list of Node IDs and offset to process for the current rank.
  */
@@ -190,137 +320,1141 @@ void _writeIndexDataset(const RawIndex& data, const std::string& name, HighFive:
     dset.select({offset, 0}, {data.size(), inner_size}).write(data);
 }
 
+/// Ranges per node counted exactly in the percentile histogram, larger counts share the last bucket
+constexpr uint64_t MAX_HISTOGRAM_RANGES = 1 << 16;
+
 /**
- * \brief Writes two datasets: node IDs to ranges, ranges to edge IDs.
+ * \brief Accumulates the ranges per node of the index rows written by this rank.
+ */
+class RangeStatistics {
+  public:
+    /// Adds the rows of nodes to ranges in \a primary, and their ranges in \a secondary
+    void add(const RawIndex& primary, const RawIndex& secondary) {
+        for (const auto& [first, end]: primary) {
+            const uint64_t count = end - first;
+            if (count == 0) {
+                continue;
+            }
+            ++nodes_;
+            minRanges_ = std::min(minRanges_, count);
+            maxRanges_ = std::max(maxRanges_, count);
+            const uint64_t bucket = std::min(count, MAX_HISTOGRAM_RANGES);
+            if (bucket >= histogram_.size()) {
+                histogram_.resize(bucket + 1, 0);
+            }
+            ++histogram_[bucket];
+        }
+        ranges_ += secondary.size();
+        for (const auto& [start, end]: secondary) {
+            edges_ += end - start;
+        }
+    }
+
+    /// Combines the statistics of all ranks
+    Fragmentation reduce() const {
+        Fragmentation result;
+        std::array<uint64_t, 3> local{nodes_, ranges_, edges_};
+        std::array<uint64_t, 3> global;
+        MPI_Allreduce(local.data(), global.data(), 3, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        result.nodes = global[0];
+        result.ranges = global[1];
+        result.edges = global[2];
+        MPI_Allreduce(&minRanges_, &result.minRangesPerNode, 1, MPI_UINT64_T, MPI_MIN, MPI_COMM_WORLD);
+        MPI_Allreduce(&maxRanges_, &result.maxRangesPerNode, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+        if (result.nodes == 0) {
+            result.minRangesPerNode = 0;
+            return result;
+        }
+
+        uint64_t buckets = histogram_.size();
+        MPI_Allreduce(MPI_IN_PLACE, &buckets, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+        auto histogram = histogram_;
+        histogram.resize(buckets, 0);
+        MPI_Allreduce(MPI_IN_PLACE, histogram.data(), buckets, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+        uint64_t seen = 0;
+        for (uint64_t count = 0; count < buckets; ++count) {
+            seen += histogram[count];
+            if (100 * seen >= 99 * result.nodes) {
+                result.p99RangesPerNode = count < MAX_HISTOGRAM_RANGES ? count : result.maxRangesPerNode;
+                break;
+            }
+        }
+        result.meanRangesPerNode = static_cast<double>(result.ranges) / result.nodes;
+        result.edgesPerRange = result.ranges == 0 ? 0.0 : static_cast<double>(result.edges) / result.ranges;
+        return result;
+    }
+
+  private:
+    uint64_t nodes_ = 0;
+    uint64_t ranges_ = 0;
+    uint64_t edges_ = 0;
+    uint64_t minRanges_ = std::numeric_limits<uint64_t>::max();
+    uint64_t maxRanges_ = 0;
+    std::vector<uint64_t> histogram_;
+};
+
+/**
+ * \brief Combines the statistics of all ranks and stores them as attributes of \a indexGroup.
+ */
+Fragmentation _writeFragmentation(HighFive::Group& indexGroup, const RangeStatistics& statistics) {
+    const auto result = statistics.reduce();
+    const auto attribute = [&indexGroup](const std::string& name, auto value) {
+        indexGroup.createAttribute<decltype(value)>(name, HighFive::DataSpace::From(value)).write(value);
+    };
+    attribute("nodes_with_edges", result.nodes);
+    attribute("total_ranges", result.ranges);
+    attribute("total_edges", result.edges);
+    attribute("min_ranges_per_node", result.minRangesPerNode);
+    attribute("mean_ranges_per_node", result.meanRangesPerNode);
+    attribute("p99_ranges_per_node", result.p99RangesPerNode);
+    attribute("max_ranges_per_node", result.maxRangesPerNode);
+    attribute("edges_per_range", result.edgesPerRange);
+    return result;
+}
+
+/**
+ * \brief Sends consecutive slices of ranges to all ranks, \a sendCounts[i] to rank i.
  *
- * Will split the work across multiple MPI nodes and gather indices as required.
+ * The exchange proceeds in rounds of at most \a bufferSize bytes sent per rank, which
+ * keeps the element counts and displacements of every round within the range of
+ * int.  Rounds are non-blocking, so that the exchanges of both indices can be in
+ * flight together, or overlap with local work.  The received ranges are ordered by
+ * sender, with the ranges of each sender starting at receiveOffsets().
+ *
+ * Collective: all ranks have to create, post and wait on exchanges in the same order.
  */
-void _writeIndexGroup(const std::string& source,
-                      uint64_t nodeCount,
-                      HighFive::Group& h5Root,
-                      const std::string& name) {
+class RangeExchange {
+  public:
+    RangeExchange(FlatRawIndex ranges, const std::vector<uint64_t>& sendCounts, uint64_t bufferSize)
+        : ranges_(std::move(ranges))
+        , sendCounts_(sendCounts)
+        , receiveCounts_(mpi::size())
+        , roundSendCounts_(mpi::size())
+        , roundSendOffsets_(mpi::size())
+        , roundReceiveCounts_(mpi::size())
+        , roundReceiveOffsets_(mpi::size()) {
+        const int size = mpi::size();
+        MPI_Alltoall(
+            sendCounts_.data(), 1, MPI_UINT64_T,
+            receiveCounts_.data(), 1, MPI_UINT64_T,
+            MPI_COMM_WORLD
+        );
 
-    auto [nodeIDs, nodeIDOffset] = _readNodeIDs(h5Root, source);
-    auto readRanges = _groupNodeRanges(nodeIDs, nodeIDOffset);
-    // sort ranges for MPI exchange
-    std::sort(std::begin(readRanges), std::end(readRanges));
+        sendOffsets_.assign(size + 1, 0);
+        std::partial_sum(sendCounts_.begin(), sendCounts_.end(), sendOffsets_.begin() + 1);
+        receiveOffsets_.assign(size + 1, 0);
+        std::partial_sum(receiveCounts_.begin(), receiveCounts_.end(), receiveOffsets_.begin() + 1);
 
-    if (nodeCount == 0) {
-        uint64_t localMaxNodeMaxID = readRanges.back()[0];
-        uint64_t globalMaxNodeID;
-        MPI_Allreduce(&localMaxNodeMaxID, &globalMaxNodeID, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
-        nodeCount = globalMaxNodeID + 1;
+        // Ranges per pair of ranks and round
+        perPeer_ = std::clamp<uint64_t>(bufferSize / INDEX_ELEMENT_SIZE / size,
+                                        1,
+                                        std::numeric_limits<int>::max() / size);
+        uint64_t localRounds = 0;
+        for (const auto count: sendCounts_) {
+            localRounds = std::max(localRounds, (count + perPeer_ - 1) / perPeer_);
+        }
+        MPI_Allreduce(&localRounds, &rounds_, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+
+        result_.resize(receiveOffsets_.back());
+    }
+
+    RangeExchange(const RangeExchange&) = delete;
+    RangeExchange& operator=(const RangeExchange&) = delete;
+
+    /**
+     * \brief Starts the next round, unless one is in flight.
+     *
+     * Returns whether a round is in flight, false once all rounds are done.
+     */
+    bool post() {
+        if (request_ != MPI_REQUEST_NULL) {
+            return true;
+        }
+        if (round_ == rounds_) {
+            return false;
+        }
+
+        const uint64_t skip = round_ * perPeer_;
+        sendBuffer_.clear();
+        int received = 0;
+        for (int rank = 0; rank < mpi::size(); ++rank) {
+            const uint64_t toSend = sendCounts_[rank] > skip ? std::min(perPeer_, sendCounts_[rank] - skip) : 0;
+            roundSendCounts_[rank] = toSend;
+            roundSendOffsets_[rank] = sendBuffer_.size();
+            if (toSend > 0) {
+                const auto first = ranges_.begin() + sendOffsets_[rank] + skip;
+                sendBuffer_.insert(sendBuffer_.end(), first, first + toSend);
+            }
+
+            const uint64_t toReceive = receiveCounts_[rank] > skip ? std::min(perPeer_, receiveCounts_[rank] - skip) : 0;
+            roundReceiveCounts_[rank] = toReceive;
+            roundReceiveOffsets_[rank] = received;
+            received += toReceive;
+        }
+        receiveBuffer_.resize(received);
+
+        MPI_Ialltoallv(
+            sendBuffer_.data(), roundSendCounts_.data(), roundSendOffsets_.data(), dt_.type(),
+            receiveBuffer_.data(), roundReceiveCounts_.data(), roundReceiveOffsets_.data(), dt_.type(),
+            MPI_COMM_WORLD, &request_
+        );
+        return true;
     }
 
-    std::vector<uint64_t> rangeCounts(nodeCount, 0);
-    for (const auto& range: readRanges) {
-        rangeCounts[range[0]]++;
+    /**
+     * \brief Completes the round in flight, if any.
+     */
+    void wait() {
+        if (request_ == MPI_REQUEST_NULL) {
+            return;
+        }
+        MPI_Wait(&request_, MPI_STATUS_IGNORE);
+
+        const uint64_t skip = round_ * perPeer_;
+        for (int rank = 0; rank < mpi::size(); ++rank) {
+            const auto first = receiveBuffer_.begin() + roundReceiveOffsets_[rank];
+            std::copy(first, first + roundReceiveCounts_[rank], result_.begin() + receiveOffsets_[rank] + skip);
+        }
+        ++round_;
+    }
+
+    /**
+     * \brief Completes the remaining rounds and returns the received ranges.
+     */
+    FlatRawIndex finish() {
+        do {
+            wait();
+        } while (post());
+
+        FlatRawIndex empty;
+        std::swap(ranges_, empty);
+        sendBuffer_ = FlatRawIndex();
+        receiveBuffer_ = FlatRawIndex();
+        return std::move(result_);
     }
 
-    std::vector<int> rangesToSend(mpi::size(), 0);
+    const std::vector<uint64_t>& receiveOffsets() const {
+        return receiveOffsets_;
+    }
+
+  private:
+    FlatRawIndex ranges_;
+    std::vector<uint64_t> sendCounts_;
+    std::vector<uint64_t> receiveCounts_;
+    std::vector<uint64_t> sendOffsets_;
+    std::vector<uint64_t> receiveOffsets_;
+    uint64_t perPeer_ = 1;
+    uint64_t rounds_ = 0;
+    uint64_t round_ = 0;
+
+    FlatRawIndex result_;
+    FlatRawIndex sendBuffer_;
+    FlatRawIndex receiveBuffer_;
+    mpi::DataType<FlatRawIndex::value_type> dt_;
+    std::vector<int> roundSendCounts_;
+    std::vector<int> roundSendOffsets_;
+    std::vector<int> roundReceiveCounts_;
+    std::vector<int> roundReceiveOffsets_;
+    MPI_Request request_ = MPI_REQUEST_NULL;
+};
+
+/**
+ * \brief The first and last range of a rank, as seen by all ranks.
+ *
+ * Gathered from every rank to decide whether the node IDs are sorted across all
+ * edges, and to join the ranges of nodes spanning several ranks.
+ */
+struct RangeBoundary {
+    /// Whether the node IDs of the rank increase with the edge IDs
+    uint64_t sorted;
+    uint64_t count;
+    uint64_t firstID;
+    uint64_t firstStart;
+    uint64_t firstEnd;
+    uint64_t lastID;
+    uint64_t lastEnd;
+};
+
+/**
+ * \brief Gathers the boundary of the unsorted \a ranges of every rank.
+ */
+std::vector<RangeBoundary> _gatherBoundaries(const FlatRawIndex& ranges) {
+    RangeBoundary local{1, ranges.size(), 0, 0, 0, 0, 0};
+    for (size_t i = 1; i < ranges.size() && local.sorted; ++i) {
+        local.sorted = ranges[i - 1][0] < ranges[i][0] && ranges[i - 1][2] <= ranges[i][1];
+    }
+    if (!ranges.empty()) {
+        local.firstID = ranges.front()[0];
+        local.firstStart = ranges.front()[1];
+        local.firstEnd = ranges.front()[2];
+        local.lastID = ranges.back()[0];
+        local.lastEnd = ranges.back()[2];
+    }
+
+    mpi::DataType<RangeBoundary> boundaryType;
+    std::vector<RangeBoundary> result(mpi::size());
+    MPI_Allgather(&local, 1, boundaryType.type(),
+                  result.data(), 1, boundaryType.type(),
+                  MPI_COMM_WORLD);
+    return result;
+}
+
+/**
+ * \brief Lists the ranks with edges if the node IDs are sorted over all edges, i.e.,
+ * every node has a single range of edges.
+ *
+ * The edges of the ranks have to follow the rank order.  Returns an empty list
+ * otherwise.
+ */
+std::vector<uint64_t> _sortedRankOrder(const std::vector<RangeBoundary>& boundaries) {
+    std::vector<uint64_t> order;
+    for (uint64_t rank = 0; rank < boundaries.size(); ++rank) {
+        if (!boundaries[rank].sorted) {
+            return {};
+        }
+        if (boundaries[rank].count > 0) {
+            order.push_back(rank);
+        }
+    }
+    for (size_t i = 1; i < order.size(); ++i) {
+        const auto& previous = boundaries[order[i - 1]];
+        const auto& next = boundaries[order[i]];
+        // A node continued by the next rank has to continue its range of edges
+        const bool ordered = previous.lastID < next.firstID
+                             || (previous.lastID == next.firstID && previous.lastEnd == next.firstStart);
+        if (!ordered || previous.lastEnd > next.firstStart) {
+            return {};
+        }
+    }
+    if (order.empty()) {
+        // No edges at all: trivially sorted, but keep the general path
+        return {};
+    }
+    return order;
+}
+
+/**
+ * \brief Writes the index of globally sorted \a ranges without exchanging them.
+ *
+ * Every rank keeps its ranges, and writes the node rows from its first node ID up
+ * to the first node ID of the next rank in \a order.  A node spanning several ranks
+ * is owned by the first of them, which extends its last range to the end of the
+ * node's edges.
+ */
+Fragmentation _writeSortedIndexGroup(FlatRawIndex ranges,
+                            const std::vector<RangeBoundary>& boundaries,
+                            const std::vector<uint64_t>& order,
+                            uint64_t nodeCount,
+                            HighFive::Group& h5Root,
+                            const std::string& name) {
+    if (boundaries[order.back()].lastID >= nodeCount) {
+        throw std::runtime_error("Node IDs exceed the node count");
+    }
+
+    const auto position = std::find(order.begin(), order.end(), mpi::rank()) - order.begin();
+    const bool hasRanges = position < static_cast<ptrdiff_t>(order.size());
+
+    // The first range continues the last one of the previous rank
+    bool continued = false;
+    if (hasRanges && position > 0) {
+        continued = boundaries[order[position - 1]].lastID == ranges.front()[0];
+    }
+    if (hasRanges) {
+        for (size_t next = position + 1; next < order.size(); ++next) {
+            const auto& boundary = boundaries[order[next]];
+            if (boundary.firstID != ranges.back()[0]) {
+                break;
+            }
+            ranges.back()[2] = boundary.firstEnd;
+            if (boundary.count > 1) {
+                break;
+            }
+        }
+    }
+
+    const uint64_t firstKept = continued ? 1 : 0;
+    const uint64_t rangeCount = hasRanges ? ranges.size() - firstKept : 0;
+    uint64_t localRangeOffset = 0;
+    uint64_t globalRangeCount = 0;
+    MPI_Exscan(&rangeCount, &localRangeOffset, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&rangeCount, &globalRangeCount, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    if (mpi::rank() == 0) {
+        localRangeOffset = 0;
+    }
+
+    uint64_t localNodeOffset = 0;
+    RawIndex primaryIndex;
+    RawIndex secondaryIndex;
+    if (hasRanges) {
+        localNodeOffset = position == 0 ? 0 : ranges.front()[0];
+        const uint64_t nodeEnd = position + 1 == static_cast<ptrdiff_t>(order.size())
+                                 ? nodeCount
+                                 : boundaries[order[position + 1]].firstID;
+        primaryIndex.resize(nodeEnd - localNodeOffset, {0, 0});
+        secondaryIndex.reserve(rangeCount);
+        if (continued && ranges.front()[0] < nodeEnd) {
+            // The range of the node was written by a lower rank, as the last one
+            primaryIndex[ranges.front()[0] - localNodeOffset] = {localRangeOffset - 1, localRangeOffset};
+        }
+        for (size_t i = firstKept; i < ranges.size(); ++i) {
+            const auto& [id, start, end] = ranges[i];
+            const uint64_t range = localRangeOffset + secondaryIndex.size();
+            if (id < nodeEnd) {
+                primaryIndex[id - localNodeOffset] = {range, range + 1};
+            }
+            secondaryIndex.push_back({start, end});
+        }
+    }
+
+    auto indexGroup = h5Root.createGroup(name);
+    _writeIndexDataset(primaryIndex, NODE_ID_TO_RANGES_DSET, indexGroup, localNodeOffset, nodeCount);
+    _writeIndexDataset(secondaryIndex, RANGE_TO_EDGE_ID_DSET, indexGroup, localRangeOffset, globalRangeCount);
+
+    RangeStatistics statistics;
+    statistics.add(primaryIndex, secondaryIndex);
+    return _writeFragmentation(indexGroup, statistics);
+}
+
+/**
+ * \brief Counts the ranges sent to every rank, when the \a nodeCount nodes starting
+ * at \a firstNode are partitioned between the ranks.
+ *
+ * The ranges have to be sorted by node ID.
+ */
+std::vector<uint64_t> _rangesPerRank(const FlatRawIndex& sortedRanges, uint64_t firstNode, uint64_t nodeCount) {
+    std::vector<uint64_t> result(mpi::size(), 0);
+    auto partitionStart = std::lower_bound(
+        sortedRanges.begin(), sortedRanges.end(), firstNode,
+        [](const FlatRawIndex::value_type& range, uint64_t id) { return range[0] < id; });
+    if (partitionStart != sortedRanges.begin()) {
+        throw std::runtime_error("Node IDs precede the indexed nodes");
+    }
     for (int rank = 0; rank < mpi::size(); ++rank) {
         const auto [offset, count] = partition_count(nodeCount, rank);
-        for (int i = offset; i < offset + count; ++i) {
-            rangesToSend[rank] += rangeCounts[i];
+        const auto partitionEnd = std::lower_bound(
+            partitionStart, sortedRanges.end(), firstNode + offset + count,
+            [](const FlatRawIndex::value_type& range, uint64_t id) { return range[0] < id; });
+        result[rank] = partitionEnd - partitionStart;
+        partitionStart = partitionEnd;
+    }
+    if (partitionStart != sortedRanges.end()) {
+        throw std::runtime_error("Node IDs exceed the node count");
+    }
+    return result;
+}
+
+/**
+ * \brief An index group between collecting its ranges and writing it.
+ */
+struct PendingIndexGroup {
+    std::string name;
+    uint64_t nodeCount;
+    /// The first and last ranges of all ranks
+    std::vector<RangeBoundary> boundaries;
+    /// The ranks with edges, if the node IDs are sorted across all ranks
+    std::vector<uint64_t> sortedOrder;
+    /// The ranges of this rank, kept as they are if sorted
+    FlatRawIndex ranges;
+    /// Otherwise, the ranges on their way to the ranks writing them
+    std::unique_ptr<RangeExchange> exchange;
+    /// Threads to merge the received ranges with
+    unsigned threads;
+};
+
+/**
+ * \brief Prepares the ranges of an index group and posts the first round of their
+ * exchange, if needed.
+ */
+PendingIndexGroup _startIndexGroup(FlatRawIndex readRanges,
+                                   uint64_t nodeCount,
+                                   const std::string& name,
+                                   const Options& options) {
+    PendingIndexGroup group{name, nodeCount};
+    group.threads = options.threads;
+
+    if (group.nodeCount == 0) {
+        // Ranks without edges do not raise the maximum
+        uint64_t localNodeCount = 0;
+        for (const auto& range: readRanges) {
+            localNodeCount = std::max(localNodeCount, range[0] + 1);
         }
+        MPI_Allreduce(&localNodeCount, &group.nodeCount, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
     }
 
-    // exchange send range
-    std::vector<int> rangesToReceive(mpi::size(), 0);
-    MPI_Alltoall(
-        rangesToSend.data(), 1, MPI_INT,
-        rangesToReceive.data(), 1, MPI_INT,
-        MPI_COMM_WORLD
-    );
+    // Sorted node IDs need neither sorting nor exchanging the ranges
+    group.boundaries = _gatherBoundaries(readRanges);
+    group.sortedOrder = _sortedRankOrder(group.boundaries);
+    if (!group.sortedOrder.empty()) {
+        group.ranges = std::move(readRanges);
+        return group;
+    }
 
-    FlatRawIndex writeRanges(std::accumulate(rangesToReceive.begin(), rangesToReceive.end(), uint64_t{0}));
-    mpi::DataType<FlatRawIndex::value_type> dt;
+    // sort ranges for MPI exchange
+    _sortRanges(readRanges, options.threads);
 
-    std::vector<int> offsetsToSend(mpi::size() + 1);
-    std::partial_sum(rangesToSend.begin(), rangesToSend.end(), offsetsToSend.begin() + 1);
+    const auto rangesToSend = _rangesPerRank(readRanges, 0, group.nodeCount);
+    group.exchange = std::make_unique<RangeExchange>(std::move(readRanges), rangesToSend, options.exchangeBufferSize);
+    group.exchange->post();
+    return group;
+}
 
-    std::vector<int> offsetsToReceive(mpi::size() + 1);
-    std::partial_sum(rangesToReceive.begin(), rangesToReceive.end(), offsetsToReceive.begin() + 1);
+/**
+ * \brief Completes the round of the exchange of \a group in flight and posts the next.
+ *
+ * Returns whether the exchange has a round in flight.
+ */
+bool _advanceIndexGroup(PendingIndexGroup& group) {
+    if (!group.exchange) {
+        return false;
+    }
+    group.exchange->wait();
+    return group.exchange->post();
+}
 
-    MPI_Alltoallv(
-        readRanges.data(), rangesToSend.data(), offsetsToSend.data(), dt.type(),
-        writeRanges.data(), rangesToReceive.data(), offsetsToReceive.data(), dt.type(),
-        MPI_COMM_WORLD
-    );
+/**
+ * \brief Writes two datasets: node IDs to ranges, ranges to edge IDs.
+ *
+ * Completes the exchange of the ranges, unless the node IDs are already sorted
+ * across all ranks.
+ */
+Fragmentation _finishIndexGroup(PendingIndexGroup& group, HighFive::Group& h5Root) {
+    if (!group.exchange) {
+        return _writeSortedIndexGroup(std::move(group.ranges), group.boundaries, group.sortedOrder,
+                                      group.nodeCount, h5Root, group.name);
+    }
+
+    auto writeRanges = group.exchange->finish();
+
+    // Every rank sent its ranges sorted
+    _mergeSortedRuns(writeRanges, group.exchange->receiveOffsets(), group.threads);
+    group.exchange.reset();
+
+    const auto [localNodeOffset, localNodeCount] = partition_count(group.nodeCount);
+    auto [primaryIndex, secondaryIndex] = _buildIndex(writeRanges, localNodeOffset, localNodeCount);
 
     {
         FlatRawIndex empty;
-        std::swap(readRanges, empty);
+        std::swap(writeRanges, empty);
     }
 
-    const auto [localNodeOffset, localNodeCount] = partition_count(nodeCount);
-    const auto nodeToRanges = _regroupNodeRanges(writeRanges);
+    const uint64_t rangeCount = secondaryIndex.size();
+    std::vector<uint64_t> allRangeCounts(mpi::size());
+    MPI_Allgather(
+        &rangeCount, 1, MPI_UINT64_T,
+        allRangeCounts.data(), 1, MPI_UINT64_T,
+        MPI_COMM_WORLD
+    );
+
+    const uint64_t localRangeOffset = std::accumulate(allRangeCounts.begin(), allRangeCounts.begin() + mpi::rank(), uint64_t{0});
+    const uint64_t globalRangeCount = std::accumulate(allRangeCounts.begin(), allRangeCounts.end(), uint64_t{0});
+
+    for (auto& ranges: primaryIndex) {
+        if (ranges[1] > ranges[0]) {
+            ranges[0] += localRangeOffset;
+            ranges[1] += localRangeOffset;
+        }
+    }
+
+    auto indexGroup = h5Root.createGroup(group.name);
+    _writeIndexDataset(primaryIndex, NODE_ID_TO_RANGES_DSET, indexGroup, localNodeOffset, group.nodeCount);
+    _writeIndexDataset(secondaryIndex, RANGE_TO_EDGE_ID_DSET, indexGroup, localRangeOffset, globalRangeCount);
+
+    RangeStatistics statistics;
+    statistics.add(primaryIndex, secondaryIndex);
+    return _writeFragmentation(indexGroup, statistics);
+}
+
+/**
+ * \brief Writes a single index group.
+ *
+ * Will split the work across multiple MPI nodes and gather indices as required.
+ */
+Fragmentation _writeIndexGroup(FlatRawIndex readRanges,
+                               uint64_t nodeCount,
+                               HighFive::Group& h5Root,
+                               const std::string& name,
+                               const Options& options) {
+    auto group = _startIndexGroup(std::move(readRanges), nodeCount, name, options);
+    return _finishIndexGroup(group, h5Root);
+}
+
+/**
+ * \brief Writes both index groups at once.
+ *
+ * The target ranges are sorted while the source ones are exchanged, the rounds of
+ * both exchanges are in flight together, and the source index is written while the
+ * last round of the target exchange completes.
+ */
+Summary _writeIndexGroups(FlatRawIndex sourceRanges,
+                          FlatRawIndex targetRanges,
+                          uint64_t sourceNodeCount,
+                          uint64_t targetNodeCount,
+                          HighFive::Group& h5Root,
+                          const Options& options) {
+    auto source = _startIndexGroup(std::move(sourceRanges), sourceNodeCount, SOURCE_INDEX_GROUP, options);
+    auto target = _startIndexGroup(std::move(targetRanges), targetNodeCount, TARGET_INDEX_GROUP, options);
+
+    while (_advanceIndexGroup(source)) {
+        _advanceIndexGroup(target);
+    }
+
+    Summary summary;
+    summary.source = _finishIndexGroup(source, h5Root);
+    summary.target = _finishIndexGroup(target, h5Root);
+    return summary;
+}
+
+/**
+ * \brief Calls \a process with the ranges of the node IDs in \a dataset assigned to
+ * this rank, reading at most \a chunkSize node IDs at once.
+ *
+ * Produces the same ranges as _groupNodeRanges() for the whole slice of the rank.
+ */
+template <typename Function>
+void _forEachNodeRange(const HighFive::DataSet& dataset, uint64_t chunkSize, Function process) {
+    const auto [offset, count] = partition_count(dataset.getElementCount());
+    std::vector<NodeID> nodeIDs;
+    FlatRawIndex::value_type current{0, offset, offset};
+    for (uint64_t start = offset; start < offset + count; start += chunkSize) {
+        const uint64_t length = std::min(chunkSize, offset + count - start);
+        dataset.select({start}, {length}).read(nodeIDs);
+        for (uint64_t i = 0; i < length; ++i) {
+            if (current[2] > current[1] && nodeIDs[i] == current[0]) {
+                ++current[2];
+                continue;
+            }
+            if (current[2] > current[1]) {
+                process(current);
+            }
+            current = {nodeIDs[i], start + i, start + i + 1};
+        }
+    }
+    if (current[2] > current[1]) {
+        process(current);
+    }
+}
+
+/**
+ * \brief Consecutive nodes indexed together, and the position of their ranges.
+ */
+struct IndexPass {
+    uint64_t firstNode;
+    uint64_t endNode;
+    uint64_t rangeOffset;
+    uint64_t rangeCount;
+};
+
+/// Maximum number of node buckets used to split the nodes into passes
+constexpr uint64_t MAX_PASS_BUCKETS = 1 << 16;
+
+/**
+ * \brief Splits the nodes into passes with at most \a maxPassRanges ranges per rank.
+ *
+ * Counts the ranges of buckets of consecutive nodes over all ranks, reading the
+ * node IDs of \a dataset in chunks of \a chunkSize.  Ranges of a node that span
+ * the slices of two ranks are counted once, as they are merged when building the
+ * index.
+ *
+ * A rank holds the ranges of a pass it read before the exchange, and the ranges of
+ * its share of the nodes of the pass after it.  Both are bounded from the bucket
+ * counts: the former by the largest count of every bucket on any rank, the latter
+ * by the largest sum of as many consecutive buckets as a share can overlap.  The
+ * bounds only grow with the pass, which is extended by a galloping search, so
+ * planning does not depend on the number of ranks.  A pass holds at least one
+ * bucket, and may exceed the limit for buckets with too many ranges.
+ */
+std::vector<IndexPass> _planPasses(const HighFive::DataSet& dataset,
+                                   uint64_t nodeCount,
+                                   uint64_t chunkSize,
+                                   uint64_t maxPassRanges) {
+    const uint64_t bucketWidth = std::max<uint64_t>(1, (nodeCount + MAX_PASS_BUCKETS - 1) / MAX_PASS_BUCKETS);
+    const uint64_t bucketCount = (nodeCount + bucketWidth - 1) / bucketWidth;
+
+    // Count, first and last node ID of the ranges of this rank
+    std::array<uint64_t, 3> boundary{0, 0, 0};
+    uint64_t localNodeCount = 0;
+    std::vector<uint64_t> localHistogram(bucketCount, 0);
+    _forEachNodeRange(dataset, chunkSize, [&](const FlatRawIndex::value_type& range) {
+        localNodeCount = std::max(localNodeCount, range[0] + 1);
+        if (range[0] < nodeCount) {
+            ++localHistogram[range[0] / bucketWidth];
+        }
+        if (boundary[0]++ == 0) {
+            boundary[1] = range[0];
+        }
+        boundary[2] = range[0];
+    });
+
+    uint64_t globalNodeCount;
+    MPI_Allreduce(&localNodeCount, &globalNodeCount, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+    if (globalNodeCount > nodeCount) {
+        throw std::runtime_error("Node IDs exceed the node count");
+    }
+
+    std::vector<uint64_t> histogram(bucketCount);
+    MPI_Allreduce(localHistogram.data(), histogram.data(), bucketCount, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+    std::vector<uint64_t> maxHistogram(bucketCount);
+    MPI_Allreduce(localHistogram.data(), maxHistogram.data(), bucketCount, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+
+    // The slices of the ranks are consecutive
+    std::vector<std::array<uint64_t, 3>> boundaries(mpi::size());
+    MPI_Allgather(boundary.data(), 3, MPI_UINT64_T,
+                  boundaries.data(), 3, MPI_UINT64_T,
+                  MPI_COMM_WORLD);
+    const std::array<uint64_t, 3>* previous = nullptr;
+    for (const auto& next: boundaries) {
+        if (next[0] == 0) {
+            continue;
+        }
+        if (previous != nullptr && (*previous)[2] == next[1]) {
+            --histogram[next[1] / bucketWidth];
+        }
+        previous = &next;
+    }
+
+    std::vector<uint64_t> bucketOffsets(bucketCount + 1, 0);
+    std::partial_sum(histogram.begin(), histogram.end(), bucketOffsets.begin() + 1);
+    std::vector<uint64_t> maxOffsets(bucketCount + 1, 0);
+    std::partial_sum(maxHistogram.begin(), maxHistogram.end(), maxOffsets.begin() + 1);
+
+    // Whether the buckets [first, end) stay within the limit on every rank
+    const uint64_t ranks = mpi::size();
+    const auto fits = [&](uint64_t first, uint64_t end) {
+        if (maxOffsets[end] - maxOffsets[first] > maxPassRanges) {
+            return false;
+        }
+        // A share of the nodes overlaps at most this many consecutive buckets
+        const uint64_t passNodes = std::min(nodeCount, end * bucketWidth) - first * bucketWidth;
+        const uint64_t share = (passNodes + ranks - 1) / ranks;
+        const uint64_t width = std::min(end - first, (share + bucketWidth - 2) / bucketWidth + 1);
+        for (uint64_t bucket = first; bucket + width <= end; ++bucket) {
+            if (bucketOffsets[bucket + width] - bucketOffsets[bucket] > maxPassRanges) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // Both bounds grow with the pass: gallop, then bisect for its last bucket
+    std::vector<IndexPass> passes;
+    for (uint64_t first = 0; first < bucketCount;) {
+        uint64_t end = first + 1;
+        uint64_t tooFar = bucketCount + 1;
+        for (uint64_t step = 1; end < bucketCount; step *= 2) {
+            const uint64_t next = std::min(bucketCount, end + step);
+            if (!fits(first, next)) {
+                tooFar = next;
+                break;
+            }
+            end = next;
+        }
+        while (tooFar <= bucketCount && tooFar - end > 1) {
+            const uint64_t middle = end + (tooFar - end) / 2;
+            if (fits(first, middle)) {
+                end = middle;
+            } else {
+                tooFar = middle;
+            }
+        }
+        passes.push_back({first * bucketWidth,
+                          std::min(nodeCount, end * bucketWidth),
+                          bucketOffsets[first],
+                          bucketOffsets[end] - bucketOffsets[first]});
+        first = end;
+    }
+    return passes;
+}
+
+/**
+ * \brief Ranges of edges set aside in files, one per pass.
+ *
+ * Ranges are buffered up to \a bufferSize bytes before being appended to their
+ * files.  The files are removed when read or when the object is destroyed.
+ */
+class SpillFiles {
+  public:
+    SpillFiles(const fs::path& directory, const std::string& name, size_t count, uint64_t bufferSize)
+        : buffers_(count)
+        , bufferSize_(std::max<uint64_t>(1, bufferSize / INDEX_ELEMENT_SIZE)) {
+        auto prefix = name;
+        std::replace(prefix.begin(), prefix.end(), '/', '_');
+        for (size_t i = 0; i < count; ++i) {
+            paths_.push_back(directory / (prefix + "." + std::to_string(mpi::rank()) + "." + std::to_string(i)));
+            std::ofstream truncate(paths_.back(), std::ios::binary | std::ios::trunc);
+        }
+    }
+
+    ~SpillFiles() {
+        for (const auto& path: paths_) {
+            std::error_code ignored;
+            fs::remove(path, ignored);
+        }
+    }
+
+    SpillFiles(const SpillFiles&) = delete;
+    SpillFiles& operator=(const SpillFiles&) = delete;
+
+    void add(size_t file, const FlatRawIndex::value_type& range) {
+        buffers_[file].push_back(range);
+        if (++buffered_ >= bufferSize_) {
+            flush();
+        }
+    }
+
+    /// Appends the buffered ranges to their files
+    void flush() {
+        for (size_t i = 0; i < buffers_.size(); ++i) {
+            if (buffers_[i].empty()) {
+                continue;
+            }
+            std::ofstream file(paths_[i], std::ios::binary | std::ios::app);
+            file.write(reinterpret_cast<const char*>(buffers_[i].data()), buffers_[i].size() * INDEX_ELEMENT_SIZE);
+            if (!file) {
+                throw std::runtime_error("Failed to write index ranges to " + paths_[i].string());
+            }
+            buffers_[i].clear();
+        }
+        buffered_ = 0;
+    }
+
+    /// Returns the ranges of a file and removes it
+    FlatRawIndex read(size_t file) {
+        FlatRawIndex result(fs::file_size(paths_[file]) / INDEX_ELEMENT_SIZE);
+        {
+            std::ifstream input(paths_[file], std::ios::binary);
+            input.read(reinterpret_cast<char*>(result.data()), result.size() * INDEX_ELEMENT_SIZE);
+            if (!input) {
+                throw std::runtime_error("Failed to read index ranges from " + paths_[file].string());
+            }
+        }
+        fs::remove(paths_[file]);
+        return result;
+    }
+
+  private:
+    std::vector<fs::path> paths_;
+    std::vector<FlatRawIndex> buffers_;
+    uint64_t bufferSize_;
+    uint64_t buffered_ = 0;
+};
+
+/**
+ * \brief Exchanges the ranges of a pass and writes their part of the index.
+ */
+void _writeIndexPass(FlatRawIndex ranges,
+                     const IndexPass& pass,
+                     HighFive::DataSet& primaryDataset,
+                     HighFive::DataSet& secondaryDataset,
+                     RangeStatistics& statistics,
+                     const Options& options) {
+    _sortRanges(ranges, options.threads);
+
+    const uint64_t passNodeCount = pass.endNode - pass.firstNode;
+    const auto rangesToSend = _rangesPerRank(ranges, pass.firstNode, passNodeCount);
+    RangeExchange exchange(std::move(ranges), rangesToSend, options.exchangeBufferSize);
+    auto writeRanges = exchange.finish();
+    _mergeSortedRuns(writeRanges, exchange.receiveOffsets(), options.threads);
+
+    const auto [localNodeOffset, localNodeCount] = partition_count(passNodeCount);
+    auto [primaryIndex, secondaryIndex] = _buildIndex(writeRanges, pass.firstNode + localNodeOffset, localNodeCount);
 
     {
         FlatRawIndex empty;
         std::swap(writeRanges, empty);
     }
 
-    const uint64_t rangeCount =
-        std::accumulate(nodeToRanges.begin(),
-                        nodeToRanges.end(),
-                        uint64_t{0},
-                        [](uint64_t total, decltype(nodeToRanges)::const_reference item) {
-                            return total + item.second.size();
-                        });
-
+    const uint64_t rangeCount = secondaryIndex.size();
     std::vector<uint64_t> allRangeCounts(mpi::size());
     MPI_Allgather(
         &rangeCount, 1, MPI_UINT64_T,
         allRangeCounts.data(), 1, MPI_UINT64_T,
         MPI_COMM_WORLD
     );
+    if (std::accumulate(allRangeCounts.begin(), allRangeCounts.end(), uint64_t{0}) != pass.rangeCount) {
+        throw std::runtime_error("Node IDs changed while indexing");
+    }
 
-    const uint64_t localRangeOffset = std::accumulate(allRangeCounts.begin(), allRangeCounts.begin() + mpi::rank(), uint64_t{0});
-    const uint64_t globalRangeCount = std::accumulate(allRangeCounts.begin(), allRangeCounts.end(), uint64_t{0});
+    const uint64_t localRangeOffset = pass.rangeOffset + std::accumulate(allRangeCounts.begin(), allRangeCounts.begin() + mpi::rank(), uint64_t{0});
+    for (auto& ranges: primaryIndex) {
+        if (ranges[1] > ranges[0]) {
+            ranges[0] += localRangeOffset;
+            ranges[1] += localRangeOffset;
+        }
+    }
 
-    RawIndex primaryIndex;
-    RawIndex secondaryIndex;
+    constexpr auto inner_size = std::tuple_size<RawIndex::value_type>::value;
+    primaryDataset.select({pass.firstNode + localNodeOffset, 0}, {primaryIndex.size(), inner_size}).write(primaryIndex);
+    secondaryDataset.select({localRangeOffset, 0}, {secondaryIndex.size(), inner_size}).write(secondaryIndex);
+    statistics.add(primaryIndex, secondaryIndex);
+}
 
-    primaryIndex.reserve(localNodeCount);
-    secondaryIndex.reserve(rangeCount);
+/**
+ * \brief Writes an index group within the memory budget of \a options, reading the
+ * node IDs of \a column in several passes over consecutive nodes.
+ *
+ * With a scratch directory, the node IDs are read twice: once to plan the passes,
+ * and once to set the ranges of every pass aside in files.  Otherwise, they are
+ * read again for every pass.
+ */
+Fragmentation _writeIndexGroupInPasses(HighFive::Group& h5Root,
+                                       const std::string& column,
+                                       uint64_t nodeCount,
+                                       const std::string& name,
+                                       const Options& options) {
+    // Node IDs read at once, and ranges per pass and rank, with four copies of the
+    // ranges of a pass in memory as estimated by _readNodeIDs()
+    const auto dataset = h5Root.getDataSet(column);
+    const uint64_t chunkSize = std::max<uint64_t>(1, options.memoryBudget / 4 / sizeof(NodeID));
+    const uint64_t maxPassRanges = std::max<uint64_t>(1, options.memoryBudget / (4 * INDEX_ELEMENT_SIZE));
+
+    if (nodeCount == 0) {
+        uint64_t localNodeCount = 0;
+        _forEachNodeRange(dataset, chunkSize, [&localNodeCount](const FlatRawIndex::value_type& range) {
+            localNodeCount = std::max(localNodeCount, range[0] + 1);
+        });
+        MPI_Allreduce(&localNodeCount, &nodeCount, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+    }
+
+    const auto passes = _planPasses(dataset, nodeCount, chunkSize, maxPassRanges);
+    const uint64_t globalRangeCount = passes.empty() ? 0 : passes.back().rangeOffset + passes.back().rangeCount;
+    if (mpi::rank() == 0) {
+        std::cout << "Indexing " << name << " in " << passes.size() << " passes" << std::endl;
+    }
+
+    auto indexGroup = h5Root.createGroup(name);
+    constexpr auto inner_size = std::tuple_size<RawIndex::value_type>::value;
+    auto primaryDataset = indexGroup.createDataSet<uint64_t>(NODE_ID_TO_RANGES_DSET, {nodeCount, inner_size});
+    auto secondaryDataset = indexGroup.createDataSet<uint64_t>(RANGE_TO_EDGE_ID_DSET, {globalRangeCount, inner_size});
+
+    const auto passOf = [&passes](NodeID id) {
+        return std::upper_bound(passes.begin(), passes.end(), id,
+                                [](NodeID id, const IndexPass& pass) { return id < pass.endNode; })
+               - passes.begin();
+    };
 
-    uint64_t offset = localRangeOffset;
-    for (NodeID nodeID = localNodeOffset; nodeID < localNodeOffset + localNodeCount; ++nodeID) {
-        const auto it = nodeToRanges.find(nodeID);
-        if (it == nodeToRanges.end()) {
-            primaryIndex.push_back({0, 0});
+    std::unique_ptr<SpillFiles> spill;
+    if (!options.scratchDirectory.empty()) {
+        spill = std::make_unique<SpillFiles>(options.scratchDirectory, name, passes.size(), options.memoryBudget / 4);
+        _forEachNodeRange(dataset, chunkSize, [&](const FlatRawIndex::value_type& range) {
+            spill->add(passOf(range[0]), range);
+        });
+        spill->flush();
+    }
+
+    RangeStatistics statistics;
+    for (size_t i = 0; i < passes.size(); ++i) {
+        FlatRawIndex ranges;
+        if (spill) {
+            ranges = spill->read(i);
         } else {
-            auto& ranges = it->second;
-            primaryIndex.push_back({offset, offset + ranges.size()});
-            offset += ranges.size();
-            std::move(ranges.begin(), ranges.end(), std::back_inserter(secondaryIndex));
+            _forEachNodeRange(dataset, chunkSize, [&](const FlatRawIndex::value_type& range) {
+                if (range[0] >= passes[i].firstNode && range[0] < passes[i].endNode) {
+                    ranges.push_back(range);
+                }
+            });
         }
+        _writeIndexPass(std::move(ranges), passes[i], primaryDataset, secondaryDataset, statistics, options);
     }
+    return _writeFragmentation(indexGroup, statistics);
+}
 
-    auto indexGroup = h5Root.createGroup(name);
-    _writeIndexDataset(primaryIndex, NODE_ID_TO_RANGES_DSET, indexGroup, localNodeOffset, nodeCount);
-    _writeIndexDataset(secondaryIndex, RANGE_TO_EDGE_ID_DSET, indexGroup, localRangeOffset, globalRangeCount);
+/**
+ * \brief Reads the ranges of the existing index group \a name for the node rows of this rank.
+ *
+ * Returns them in the flat form of _groupNodeRanges(), sorted by node ID.
+ */
+FlatRawIndex _readIndexRanges(const HighFive::Group& h5Root, const std::string& name) {
+    auto group = h5Root.getGroup(name);
+    auto nodeDataset = group.getDataSet(NODE_ID_TO_RANGES_DSET);
+    const auto [nodeOffset, nodeCount] = partition_count(nodeDataset.getDimensions()[0]);
+    RawIndex primary;
+    nodeDataset.select({nodeOffset, 0}, {nodeCount, 2}).read(primary);
+
+    // The ranges of consecutive nodes are consecutive
+    uint64_t firstRange = std::numeric_limits<uint64_t>::max();
+    uint64_t endRange = 0;
+    for (const auto& [start, end]: primary) {
+        if (end > start) {
+            firstRange = std::min(firstRange, start);
+            endRange = std::max(endRange, end);
+        }
+    }
+
+    FlatRawIndex ranges;
+    if (endRange == 0) {
+        return ranges;
+    }
+    RawIndex secondary;
+    group.getDataSet(RANGE_TO_EDGE_ID_DSET)
+        .select({firstRange, 0}, {endRange - firstRange, 2})
+        .read(secondary);
+    ranges.reserve(secondary.size());
+    for (uint64_t i = 0; i < primary.size(); ++i) {
+        for (uint64_t r = primary[i][0]; r < primary[i][1]; ++r) {
+            const auto& [start, end] = secondary[r - firstRange];
+            ranges.push_back({nodeOffset + i, start, end});
+        }
+    }
+    return ranges;
+}
+
+/**
+ * \brief Adds the ranges of the existing index group \a name to \a ranges, and
+ * returns the node count covering both.
+ */
+uint64_t _addIndexRanges(const HighFive::Group& h5Root,
+                         const std::string& name,
+                         uint64_t nodeCount,
+                         FlatRawIndex& ranges) {
+    const auto existing = _readIndexRanges(h5Root, name);
+    ranges.insert(ranges.end(), existing.begin(), existing.end());
+
+    uint64_t localNodeCount = h5Root.getGroup(name).getDataSet(NODE_ID_TO_RANGES_DSET).getDimensions()[0];
+    for (const auto& range: ranges) {
+        localNodeCount = std::max(localNodeCount, range[0] + 1);
+    }
+    uint64_t globalNodeCount = 0;
+    MPI_Allreduce(&localNodeCount, &globalNodeCount, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+    return std::max(nodeCount, globalNodeCount);
+}
+
+/**
+ * \brief Warns about or rejects indices with more ranges per node than allowed by \a options.
+ */
+void _checkFragmentation(const Summary& summary, const Options& options) {
+    if (options.maxMeanRangesPerNode <= 0) {
+        return;
+    }
+    for (const auto& [name, fragmentation]: {std::make_pair(SOURCE_INDEX_GROUP, summary.source),
+                                             std::make_pair(TARGET_INDEX_GROUP, summary.target)}) {
+        if (fragmentation.meanRangesPerNode <= options.maxMeanRangesPerNode) {
+            continue;
+        }
+        const std::string message = std::string(name) + " has " +
+                                    std::to_string(fragmentation.meanRangesPerNode) +
+                                    " ranges per node on average, more than " +
+                                    std::to_string(options.maxMeanRangesPerNode);
+        if (options.failOnFragmentation) {
+            throw std::runtime_error(message);
+        }
+        if (mpi::rank() == 0) {
+            std::cerr << "WARNING: " << message << std::endl;
+        }
+    }
 }
 
 }  // unnamed namespace
 
 
-void write(HighFive::Group& h5Root,
-           uint64_t sourceNodeCount,
-           uint64_t targetNodeCount) {
+Summary write(HighFive::Group& h5Root,
+              uint64_t sourceNodeCount,
+              uint64_t targetNodeCount,
+              const Options& options) {
+    if (h5Root.exist(INDEX_GROUP)) {
+        throw std::runtime_error("Index group already exists");
+    }
+
+    Summary summary;
+    if (options.memoryBudget > 0) {
+        summary.source = _writeIndexGroupInPasses(h5Root, SOURCE_NODE_ID_DSET, sourceNodeCount, SOURCE_INDEX_GROUP, options);
+        summary.target = _writeIndexGroupInPasses(h5Root, TARGET_NODE_ID_DSET, targetNodeCount, TARGET_INDEX_GROUP, options);
+    } else if (options.overlapGroups) {
+        FlatRawIndex sourceRanges;
+        {
+            const auto [nodeIDs, nodeIDOffset] = _readNodeIDs(h5Root, SOURCE_NODE_ID_DSET);
+            sourceRanges = _groupNodeRanges(nodeIDs, nodeIDOffset, options.threads);
+        }
+        FlatRawIndex targetRanges;
+        {
+            const auto [nodeIDs, nodeIDOffset] = _readNodeIDs(h5Root, TARGET_NODE_ID_DSET);
+            targetRanges = _groupNodeRanges(nodeIDs, nodeIDOffset, options.threads);
+        }
+        summary = _writeIndexGroups(std::move(sourceRanges),
+                                    std::move(targetRanges),
+                                    sourceNodeCount,
+                                    targetNodeCount,
+                                    h5Root,
+                                    options);
+    } else {
+        // One index at a time, to only keep the ranges of one in memory
+        {
+            const auto [nodeIDs, nodeIDOffset] = _readNodeIDs(h5Root, SOURCE_NODE_ID_DSET);
+            summary.source = _writeIndexGroup(_groupNodeRanges(nodeIDs, nodeIDOffset, options.threads),
+                                              sourceNodeCount,
+                                              h5Root,
+                                              SOURCE_INDEX_GROUP,
+                                              options);
+        }
+        {
+            const auto [nodeIDs, nodeIDOffset] = _readNodeIDs(h5Root, TARGET_NODE_ID_DSET);
+            summary.target = _writeIndexGroup(_groupNodeRanges(nodeIDs, nodeIDOffset, options.threads),
+                                              targetNodeCount,
+                                              h5Root,
+                                              TARGET_INDEX_GROUP,
+                                              options);
+        }
+    }
+
+    _checkFragmentation(summary, options);
+    return summary;
+}
+
+
+Summary write(HighFive::Group& h5Root,
+              uint64_t sourceNodeCount,
+              uint64_t targetNodeCount,
+              FlatRawIndex sourceRanges,
+              FlatRawIndex targetRanges,
+              const Options& options) {
     if (h5Root.exist(INDEX_GROUP)) {
         throw std::runtime_error("Index group already exists");
     }
 
-    _writeIndexGroup(SOURCE_NODE_ID_DSET,
-                     sourceNodeCount,
-                     h5Root,
-                     SOURCE_INDEX_GROUP);
-    _writeIndexGroup(TARGET_NODE_ID_DSET,
-                     targetNodeCount,
-                     h5Root,
-                     TARGET_INDEX_GROUP);
+    Summary summary;
+    if (options.overlapGroups) {
+        summary = _writeIndexGroups(std::move(sourceRanges),
+                                    std::move(targetRanges),
+                                    sourceNodeCount,
+                                    targetNodeCount,
+                                    h5Root,
+                                    options);
+    } else {
+        summary.source = _writeIndexGroup(std::move(sourceRanges),
+                                          sourceNodeCount,
+                                          h5Root,
+                                          SOURCE_INDEX_GROUP,
+                                          options);
+        summary.target = _writeIndexGroup(std::move(targetRanges),
+                                          targetNodeCount,
+                                          h5Root,
+                                          TARGET_INDEX_GROUP,
+                                          options);
+    }
+
+    _checkFragmentation(summary, options);
+    return summary;
+}
+
+
+Summary update(HighFive::Group& h5Root,
+               uint64_t sourceNodeCount,
+               uint64_t targetNodeCount,
+               FlatRawIndex sourceRanges,
+               FlatRawIndex targetRanges,
+               const Options& options) {
+    if (!h5Root.exist(INDEX_GROUP)) {
+        // The ranges only cover the appended edges
+        return write(h5Root, sourceNodeCount, targetNodeCount, options);
+    }
+
+    sourceNodeCount = _addIndexRanges(h5Root, SOURCE_INDEX_GROUP, sourceNodeCount, sourceRanges);
+    targetNodeCount = _addIndexRanges(h5Root, TARGET_INDEX_GROUP, targetNodeCount, targetRanges);
+    h5Root.unlink(INDEX_GROUP);
+
+    // Existing ranges ending where appended ones start are merged by _buildIndex()
+    return write(h5Root, sourceNodeCount, targetNodeCount,
+                 std::move(sourceRanges), std::move(targetRanges), options);
 }
 
 
@@ -1,11 +1,128 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
 #include <highfive/H5Group.hpp>
 
 namespace indexing {
 
-void write(HighFive::Group& h5Root,
-           uint64_t sourceNodeCount,
-           uint64_t targetNodeCount);
+using NodeID = uint64_t;
+/// Ranges of edges as node ID, first edge and end edge
+using FlatRawIndex = std::vector<std::array<uint64_t, 3>>;
+
+/// Settings of the index construction
+struct Options {
+    /// Bytes sent by a rank per round when exchanging ranges between ranks
+    uint64_t exchangeBufferSize = 256 * 1024 * 1024;
+    /// Builds the source and target indices together, holding the ranges of both
+    bool overlapGroups = true;
+    /**
+     * Bytes of memory per rank to build an index within, 0 for no limit.
+     *
+     * With a limit, the node IDs are read back in chunks, and the index is built in
+     * several passes over consecutive nodes.  Only applies when reading the node IDs
+     * back from the file.
+     */
+    uint64_t memoryBudget = 0;
+    /// Directory to set ranges aside in with a memory budget, instead of reading the node IDs for every pass
+    std::string scratchDirectory;
+    /// Threads per rank grouping, sorting and merging ranges
+    unsigned threads = 1;
+    /// Mean ranges per node above which an index is reported, 0 to not check
+    double maxMeanRangesPerNode = 0;
+    /// Fails instead of warning when an index exceeds \c maxMeanRangesPerNode
+    bool failOnFragmentation = false;
+};
+
+/**
+ * \brief How scattered the edges of the nodes of an index are.
+ *
+ * Every range is a separate read for readers of the edges of a node.  The ranges per
+ * node are counted over the nodes with edges.  Stored as attributes of the index
+ * groups.
+ */
+struct Fragmentation {
+    uint64_t nodes = 0;
+    uint64_t ranges = 0;
+    uint64_t edges = 0;
+    uint64_t minRangesPerNode = 0;
+    double meanRangesPerNode = 0;
+    uint64_t p99RangesPerNode = 0;
+    uint64_t maxRangesPerNode = 0;
+    /// Edges read at once on average, times the bytes per edge of a dataset gives the bytes per read
+    double edgesPerRange = 0;
+};
+
+/// The fragmentation of both indices of a population
+struct Summary {
+    Fragmentation source;
+    Fragmentation target;
+};
+
+/**
+ * \brief Groups node IDs into ranges of consecutive edges while they are written.
+ */
+class RangeCollector {
+  public:
+    /// Adds the node ID of \a edge, edges are expected in increasing order
+    inline void add(NodeID id, uint64_t edge) {
+        if (!ranges_.empty() && ranges_.back()[0] == id && ranges_.back()[2] == edge) {
+            ++ranges_.back()[2];
+        } else {
+            ranges_.push_back({id, edge, edge + 1});
+        }
+    }
+
+    /// Gives up the ranges collected so far
+    inline FlatRawIndex release() {
+        FlatRawIndex result;
+        std::swap(result, ranges_);
+        return result;
+    }
+
+  private:
+    FlatRawIndex ranges_;
+};
+
+/**
+ * \brief Writes the indices from the node IDs of \a h5Root.
+ *
+ * Collective.  Returns the fragmentation of both indices, and fails or warns if it
+ * exceeds the limit of \a options.
+ */
+Summary write(HighFive::Group& h5Root,
+              uint64_t sourceNodeCount,
+              uint64_t targetNodeCount,
+              const Options& options = {});
+
+/**
+ * \brief Writes the indices from the ranges of edges collected by this rank.
+ *
+ * Avoids reading the node IDs back from \a h5Root.  Collective, every rank
+ * passes the ranges of the edges it wrote.
+ */
+Summary write(HighFive::Group& h5Root,
+              uint64_t sourceNodeCount,
+              uint64_t targetNodeCount,
+              FlatRawIndex sourceRanges,
+              FlatRawIndex targetRanges,
+              const Options& options = {});
+
+/**
+ * \brief Updates the indices of \a h5Root after appending edges.
+ *
+ * Merges the ranges of the appended edges collected by this rank into the existing
+ * indices, which are replaced.  Without existing indices, all indices are built from
+ * the node IDs.  Collective.
+ */
+Summary update(HighFive::Group& h5Root,
+               uint64_t sourceNodeCount,
+               uint64_t targetNodeCount,
+               FlatRawIndex sourceRanges,
+               FlatRawIndex targetRanges,
+               const Options& options = {});
 
 } // namespace index
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+#include "index.h"
+
+namespace indexing {
+
+inline void to_json(nlohmann::json& json, const Fragmentation& fragmentation) {
+    json = {
+        {"nodes_with_edges", fragmentation.nodes},
+        {"total_ranges", fragmentation.ranges},
+        {"total_edges", fragmentation.edges},
+        {"min_ranges_per_node", fragmentation.minRangesPerNode},
+        {"mean_ranges_per_node", fragmentation.meanRangesPerNode},
+        {"p99_ranges_per_node", fragmentation.p99RangesPerNode},
+        {"max_ranges_per_node", fragmentation.maxRangesPerNode},
+        {"edges_per_range", fragmentation.edgesPerRange},
+    };
+}
+
+inline void to_json(nlohmann::json& json, const Summary& summary) {
+    json = {
+        {"source_to_target", summary.source},
+        {"target_to_source", summary.target},
+    };
+}
+
+/**
+ * \brief Writes the fragmentation of the indices of every population to \a filename as JSON.
+ */
+inline void write_summary(const std::string& filename, const std::map<std::string, Summary>& populations) {
+    std::ofstream file(filename);
+    file << nlohmann::json(populations).dump(4) << std::endl;
+    if (!file) {
+        throw std::runtime_error("Failed to write the index summary to " + filename);
+    }
+}
+
+} // namespace index
@@ -5,23 +5,34 @@
  * @author Fernando Pereira <fernando.pereira@epfl.ch>
  *
  */
+#include <algorithm>
+#include <climits>
 #include <stdexcept>
 #include <filesystem>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
 #include <vector>
 #include <unordered_map>
 #include <mpi.h>
 
+#include <nlohmann/json.hpp>
+
 #include "CLI/CLI.hpp"
 
 #include "circuit.h"
+#include "index/summary.h"
 #include "progress.hpp"
+#include "timing.h"
 #include "version.h"
 
 using namespace neuron_parquet::circuit;
 
 using neuron_parquet::Converter;
+using neuron_parquet::report_timing;
 using utils::ProgressMonitor;
 
 namespace fs = std::filesystem;
@@ -31,29 +42,157 @@ int mpi_size, mpi_rank;
 MPI_Comm comm = MPI_COMM_WORLD;
 MPI_Info info = MPI_INFO_NULL;
 
+///
+/// \brief report_write_sizes: Prints the histogram of HDF5 write sizes of all ranks
+///
+void report_write_sizes(const SonataFile::WriteSizes& local) {
+    SonataFile::WriteSizes total;
+    MPI_Reduce(local.data(), total.data(), local.size(), MPI_UINT64_T, MPI_SUM, 0, comm);
+    if (mpi_rank == 0) {
+        std::cout << "Dataset writes by size:" << std::endl;
+        for (size_t i = 0; i < total.size(); ++i) {
+            if (total[i] > 0) {
+                std::cout << std::setfill(' ')
+                          << "  >= " << std::setw(14) << (uint64_t{1} << i) << " bytes: "
+                          << std::setw(10) << total[i] << std::endl;
+            }
+        }
+    }
+}
+
+///
+/// \brief partition_files: Returns the offset and number of files to be read by \a rank
+///
+std::pair<int, int> partition_files(int total_files, int rank) {
+    int n_files = total_files / mpi_size;
+    int remaining = total_files % mpi_size;
+    if( rank < remaining ) {
+        n_files++;
+    }
+
+    int offset = total_files / mpi_size * rank;
+    offset += (rank > remaining) ? remaining : rank;
+    return {offset, n_files};
+}
+
+///
+/// \brief distribute_footers: Sends the footers known to the first rank to the
+///        ranks reading the corresponding \a files
+///
+void distribute_footers(const ParquetInput& input, std::vector<ParquetFileInfo>& files) {
+    std::vector<int> file_counts, file_offsets, byte_counts, byte_offsets;
+    std::vector<uint64_t> all_sizes;
+    std::string all_footers;
+    uint64_t total_bytes = 0;
+    if (mpi_rank == 0) {
+        for (const auto& footer: input.footers) {
+            total_bytes += footer.size();
+        }
+    }
+    // The counts and displacements of MPI_Scatterv are ints
+    MPI_Bcast(&total_bytes, 1, MPI_UINT64_T, 0, comm);
+    if (total_bytes > INT_MAX) {
+        throw std::runtime_error("The footers of the Parquet files exceed 2 GiB, convert fewer files at once");
+    }
+    if (mpi_rank == 0) {
+        int bytes_before = 0;
+        for (int rank = 0; rank < mpi_size; ++rank) {
+            const auto [offset, n_files] = partition_files(input.files.size(), rank);
+            file_counts.push_back(n_files);
+            file_offsets.push_back(offset);
+            int bytes = 0;
+            for (int i = offset; i < offset + n_files; ++i) {
+                bytes += input.footers[i].size();
+            }
+            byte_counts.push_back(bytes);
+            byte_offsets.push_back(bytes_before);
+            bytes_before += bytes;
+        }
+        all_footers.reserve(total_bytes);
+        for (const auto& footer: input.footers) {
+            all_sizes.push_back(footer.size());
+            all_footers += footer;
+        }
+    }
+
+    std::vector<uint64_t> sizes(files.size());
+    MPI_Scatterv(all_sizes.data(), file_counts.data(), file_offsets.data(), MPI_UINT64_T,
+                 sizes.data(), sizes.size(), MPI_UINT64_T, 0, comm);
+
+    std::string footers(std::accumulate(sizes.begin(), sizes.end(), uint64_t{0}), '\0');
+    MPI_Scatterv(all_footers.data(), byte_counts.data(), byte_offsets.data(), MPI_CHAR,
+                 footers.data(), footers.size(), MPI_CHAR, 0, comm);
+
+    uint64_t position = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+        files[i].footer = ParquetInput::deserialize_footer(footers.substr(position, sizes[i]));
+        position += sizes[i];
+    }
+}
+
+///
+/// \brief unify_libraries: Merges the string column values found by all ranks,
+///        returning the same sorted values on every rank
+///
+std::map<std::string, std::vector<std::string>> unify_libraries(
+        const std::map<std::string, std::set<std::string>>& local) {
+    const std::string serialized = nlohmann::json(local).dump();
+    int size = serialized.size();
+    std::vector<int> sizes(mpi_size), offsets(mpi_size);
+    MPI_Gather(&size, 1, MPI_INT, sizes.data(), 1, MPI_INT, 0, comm);
+    std::string all;
+    if (mpi_rank == 0) {
+        std::partial_sum(sizes.begin(), sizes.end() - 1, offsets.begin() + 1);
+        all.resize(offsets.back() + sizes.back());
+    }
+    MPI_Gatherv(serialized.data(), size, MPI_CHAR,
+                all.data(), sizes.data(), offsets.data(), MPI_CHAR, 0, comm);
+
+    std::string merged;
+    if (mpi_rank == 0) {
+        std::map<std::string, std::set<std::string>> values;
+        for (int rank = 0; rank < mpi_size; ++rank) {
+            const auto part = nlohmann::json::parse(all.substr(offsets[rank], sizes[rank]));
+            for (const auto& [name, column_values]: part.items()) {
+                const auto strings = column_values.get<std::vector<std::string>>();
+                values[name].insert(strings.begin(), strings.end());
+            }
+        }
+        merged = nlohmann::json(values).dump();
+    }
+    uint64_t merged_size = merged.size();
+    MPI_Bcast(&merged_size, 1, MPI_UINT64_T, 0, comm);
+    merged.resize(merged_size);
+    MPI_Bcast(merged.data(), merged_size, MPI_CHAR, 0, comm);
+    return nlohmann::json::parse(merged).get<std::map<std::string, std::vector<std::string>>>();
+}
+
 ///
 /// \brief convert_circuit_mpi: Converts parquet files to SYN2 using mpi
 ///
 ///
-void convert_circuit_mpi(const std::vector<std::string>& filenames,
-                         const std::string& metadata_path,
+void convert_circuit_mpi(const ParquetInput& input,
                          const std::string& sonata_path,
                          const std::string& population,
-                         const bool create_index) {
+                         const bool create_index,
+                         SonataFile::DatasetLayout layout,
+                         const SonataFile::FileTuning& tuning,
+                         const ReaderOptions& reader_options,
+                         const std::vector<std::string>& sort_by,
+                         const indexing::Options& index_options,
+                         const std::string& index_summary,
+                         bool append) {
+    const auto& filenames = input.files;
+    const auto& metadata_path = input.metadata_filename;
 
     // Each reader and each writer in a separate MPI process
-    int total_files = filenames.size();
-    int my_n_files = total_files / mpi_size;
-    int remaining = total_files % mpi_size;
-    if( mpi_rank < remaining ) {
-        my_n_files++;
-    }
+    const auto [my_offset, my_n_files] = partition_files(filenames.size(), mpi_rank);
+    // Ranks beyond the number of files read nothing
+    const bool has_files = static_cast<size_t>(mpi_rank) < filenames.size();
 
-    int my_offset = total_files / mpi_size * mpi_rank;
-    my_offset += (mpi_rank > remaining) ? remaining : mpi_rank;
-
-    std::vector<std::string> input_names(filenames.begin() + my_offset, filenames.begin() + my_offset + my_n_files);
-    if (mpi_rank < filenames.size()) {
+    std::vector<ParquetFileInfo> input_names(filenames.begin() + my_offset, filenames.begin() + my_offset + my_n_files);
+    distribute_footers(input, input_names);
+    if (has_files) {
         std::cout << std::setfill('.')
                   << "Process " << std::setw(4) << mpi_rank
                   << " is going to read files " << std::setw(8) << my_offset
@@ -65,10 +204,9 @@ void convert_circuit_mpi(const std::vector<std::string>& filenames,
     }
 
     if (input_names.empty()) {
-        // We need this to grab the schema of the input files. All ranks
-        // need to have the schema to keep the state of the output HDF5
-        // file in sync, otherwise the execution will hang when closing the
-        // output HDF5 file.
+        // The reader requires at least one file to grab a schema from.
+        // The layout of the output is determined by the first rank and
+        // shared with all others, see SonataWriter::setup.
         input_names.push_back(filenames.back());
     }
 
@@ -80,19 +218,20 @@ void convert_circuit_mpi(const std::vector<std::string>& filenames,
 
     MPI_Barrier(comm);
 
-    CircuitMultiReaderParquet reader(input_names, metadata_path);
+    // Only the first rank needs the full schema, see SonataWriter::setup
+    CircuitMultiReaderParquet reader(input_names, mpi_rank == 0 ? metadata_path : "", reader_options);
 
     // Count the records and
     // 1. Sum
     // 2. Calculate offsets
 
-    uint64_t record_count = mpi_rank < filenames.size() ? reader.record_count() : 0;
+    uint64_t record_count = has_files ? reader.record_count() : 0;
     uint64_t global_record_sum;
     MPI_Allreduce(&record_count, &global_record_sum, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
 
-    uint32_t block_count = mpi_rank < filenames.size() ? reader.block_count() : 0;
-    uint32_t global_block_sum;
-    MPI_Allreduce(&block_count, &global_block_sum, 1, MPI_UINT32_T, MPI_SUM, MPI_COMM_WORLD);
+    // Automatic chunking aligns chunks with the largest row group
+    uint64_t block_size = has_files ? reader.max_block_size() : 0;
+    MPI_Allreduce(&block_size, &layout.block_size, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
 
     uint64_t *offsets=nullptr;
     if (mpi_rank == 0) {
@@ -109,7 +248,7 @@ void convert_circuit_mpi(const std::vector<std::string>& filenames,
     uint64_t offset;
     MPI_Scatter(offsets, 1, MPI_UINT64_T, &offset, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
 
-    if (mpi_rank < filenames.size()) {
+    if (has_files) {
         std::cout << std::setfill('.')
                   << "Process " << std::setw(4) << mpi_rank
                   << " is going to write " << std::setw(12) << reader.block_count()
@@ -122,23 +261,57 @@ void convert_circuit_mpi(const std::vector<std::string>& filenames,
                   << std::endl;
     }
 
-    SonataWriter writer(sonata_path, global_record_sum, {comm, info}, offset, population);
+    // String columns become enumerations, with one library over all input files
+    double start = MPI_Wtime();
+    std::map<std::string, std::set<std::string>> local_values;
+    if (has_files) {
+        reader.dictionary_values(local_values);
+    }
+    const auto libraries = unify_libraries(local_values);
+    report_timing(comm, "collecting string values", start);
+
+    start = MPI_Wtime();
+    auto writer = std::make_unique<SonataWriter>(
+        sonata_path, global_record_sum, SonataWriter::MPI_Params{comm, info}, offset, population, layout, tuning,
+        reader_options.columns, append);
+    report_timing(comm, "opening the output", start);
+    for (const auto& [name, values]: libraries) {
+        writer->add_library(name, values);
+    }
+    if (!sort_by.empty()) {
+        writer->sort_by(sort_by);
+    }
+    if (create_index && index_options.memoryBudget == 0) {
+        // Avoids reading the node IDs back from the output
+        writer->collect_index_ranges();
+    }
 
     //Create converter and progress monitor
     {
-        Converter<CircuitData> converter(reader, writer);
-        ProgressMonitor p(global_block_sum, mpi_rank==0);
+        start = MPI_Wtime();
+        Converter<CircuitData> converter(reader, *writer);
+        report_timing(comm, "setting up the output", start);
+
+        // Counted in rows: blocks may be batches or column groups of a row group
+        ProgressMonitor p(global_record_sum, mpi_rank==0);
         // Use progress of first process to estimate global progress
         if (mpi_rank == 0) {
             p.set_parallelism(mpi_size);
-            converter.setProgressHandler(p, mpi_size);
+            converter.setProgressHandler(p, mpi_size, [](const CircuitData& data, uint32_t rows) {
+                // Rows split into column groups count once, with their last columns
+                return data.complete ? rows : 0;
+            });
         }
-        if (mpi_rank < filenames.size()) {
+        if (has_files) {
             // See above: avoid converting data if we just opened the last
             // file to access the schema.
             converter.exportAll();
         }
     }
+    start = MPI_Wtime();
+    writer->flush();
+    report_timing(comm, sort_by.empty() ? "completing writes" : "sorting and writing", start);
+    report_write_sizes(writer->write_sizes());
 
     MPI_Barrier(comm);
 
@@ -154,7 +327,10 @@ void convert_circuit_mpi(const std::vector<std::string>& filenames,
             std::cout << "Creating indices..." << std::endl;
         }
         try {
-            writer.write_indices(true);
+            const auto summary = writer->write_indices(true, index_options);
+            if (mpi_rank == 0 && !index_summary.empty()) {
+                indexing::write_summary(index_summary, {{population, summary}});
+            }
         } catch (const std::exception& e) {
             std::cerr << "ERROR on rank " << mpi_rank << ": Failed to write indices: " << e.what() << std::endl;
             throw e;
@@ -162,6 +338,18 @@ void convert_circuit_mpi(const std::vector<std::string>& filenames,
         MPI_Barrier(comm);
     }
 
+    start = MPI_Wtime();
+    writer.reset();
+    report_timing(comm, "closing the output", start);
+
+    uint64_t files_opened = CircuitReaderParquet::files_opened();
+    uint64_t global_files_opened;
+    MPI_Reduce(&files_opened, &global_files_opened, 1, MPI_UINT64_T, MPI_SUM, 0, comm);
+    if (mpi_rank == 0) {
+        std::cout << "Opened " << global_files_opened << " Parquet file(s) to convert "
+                  << filenames.size() << " input file(s)" << std::endl;
+    }
+
     if(mpi_rank == 0) {
         std::cout << "Finished writing " << sonata_path << std::endl;
     }
@@ -178,12 +366,88 @@ int main(int argc, char* argv[]) {
     std::string output_population;
     std::string input_directory;
     bool create_index = true;
+    SonataFile::DatasetLayout layout;
+    const std::map<std::string, SonataFile::DatasetLayout::Compression> compressions{
+        {"none", SonataFile::DatasetLayout::Compression::None},
+        {"deflate", SonataFile::DatasetLayout::Compression::Deflate},
+        {"szip", SonataFile::DatasetLayout::Compression::Szip}};
+    std::string tuning_profile = "default";
+    hsize_t stripe_size = 1024 * 1024;
+    ReaderOptions reader_options;
+    std::vector<std::string> sort_by;
+    indexing::Options index_options;
+    std::string index_summary;
+    bool append = false;
 
     // Every node makes his job in reading the args and
     // compute the sub array of files to process
     CLI::App app{"Convert Parquet synapse files into the SONATA format"};
     app.set_version_flag("-v,--version", neuron_parquet::VERSION);
     app.add_flag("--index,!--no-index", create_index, "Create a SONATA index");
+    app.add_option("--index-buffer-size", index_options.exchangeBufferSize,
+                   "Bytes sent per rank and round when exchanging index ranges");
+    app.add_flag("!--index-sequential", index_options.overlapGroups,
+                 "Build the source and target indices one after the other, using less memory");
+    auto memory_budget = app.add_option("--index-memory-budget", index_options.memoryBudget,
+                                        "Bytes of memory per rank to build the indices in several passes within");
+    app.add_option("--index-scratch-dir", index_options.scratchDirectory,
+                   "Directory for the ranges of the passes of --index-memory-budget")
+        ->check(CLI::ExistingDirectory)
+        ->needs(memory_budget);
+    app.add_option("--index-threads", index_options.threads,
+                   "Threads per rank grouping and sorting index ranges")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--index-summary", index_summary,
+                   "Write the fragmentation of the indices to this JSON file");
+    app.add_option("--max-ranges-per-node", index_options.maxMeanRangesPerNode,
+                   "Warn when the indices have more ranges per node on average");
+    app.add_flag("--fail-on-fragmentation", index_options.failOnFragmentation,
+                 "Fail instead of warning with --max-ranges-per-node");
+    app.add_option("--compression", layout.compression, "Compression filter for the datasets")
+        ->transform(CLI::CheckedTransformer(compressions, CLI::ignore_case));
+    app.add_option("--compression-level", layout.compression_level, "Deflate compression level")
+        ->check(CLI::Range(0, 9));
+    app.add_flag("--shuffle", layout.shuffle, "Shuffle bytes before compressing");
+    app.add_flag("--checksum", layout.checksum, "Store Fletcher32 checksums with the data");
+    app.add_option("--chunk-size", layout.chunk_size,
+                   "Rows per dataset chunk; when compressing, defaults to the row group size");
+    app.add_option("--write-buffer-size", layout.staging_size,
+                   "Collect consecutive rows of a dataset up to this many bytes before writing");
+    app.add_option("--tuning", tuning_profile, "File layout tuning profile")
+        ->check(CLI::IsMember({"default", "lustre"}));
+    app.add_option("--stripe-size", stripe_size, "File system stripe size in bytes, used for tuning");
+    auto batch_rows = app.add_option("--batch-rows", reader_options.batch_rows,
+                                     "Read row groups in batches of at most this many rows");
+    auto batch_bytes = app.add_option("--batch-bytes", reader_options.batch_bytes,
+                                      "Read row groups in batches of at most this many uncompressed bytes");
+    auto columns_per_read = app.add_option("--columns-per-read", reader_options.columns_per_read,
+                                           "Read and write row groups this many columns at a time")
+        ->excludes(batch_rows)
+        ->excludes(batch_bytes);
+    app.add_option("--sort-by", sort_by,
+                   "Sort the edges by these node ID columns, e.g. target_node_id,source_node_id")
+        ->delimiter(',')
+        ->expected(1, 2)
+        ->check(CLI::IsMember({"source_node_id", "target_node_id"}))
+        ->excludes(columns_per_read);
+    app.add_option("--read-buffer-size", reader_options.buffer_size,
+                   "Read Parquet files through a buffer of this many bytes");
+    app.add_flag("--memory-map", reader_options.memory_map, "Memory-map the Parquet files");
+    app.add_flag("--pre-buffer", reader_options.pre_buffer,
+                 "Read all columns of a row group ahead of decoding, coalescing reads");
+    app.add_option("--hole-size-limit", reader_options.hole_size_limit,
+                   "With --pre-buffer, merge reads separated by at most this many bytes");
+    app.add_option("--range-size-limit", reader_options.range_size_limit,
+                   "With --pre-buffer, do not merge reads beyond this many bytes");
+    app.add_flag("--reader-threads", reader_options.use_threads,
+                 "Decode Parquet columns with multiple threads");
+    auto include = app.add_option("--columns", reader_options.columns.include,
+                                  "Only convert these columns")
+        ->delimiter(',');
+    app.add_option("--exclude-columns", reader_options.columns.exclude,
+                   "Do not convert these columns")
+        ->delimiter(',')
+        ->excludes(include);
     app.add_option("input_directory", input_directory, "Directory containing Parquet files to convert")
         ->check(CLI::ExistingDirectory)
         ->required();
@@ -191,6 +455,8 @@ int main(int argc, char* argv[]) {
         ->required();
     app.add_option("output_population", output_population, "Population to write")
         ->required();
+    app.add_flag("--append", append,
+                 "Append the edges to the existing population of the output, which has to be chunked");
 
     try {
         app.parse(argc, argv);
@@ -202,38 +468,77 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    std::string metadata_file = "";
-    std::vector<std::string> input_files;
-    {
-        fs::path p(input_directory);
+    for (const auto& name: sort_by) {
+        if (!reader_options.columns.selected(name) ||
+            std::count(sort_by.begin(), sort_by.end(), name) > 1) {
+            if (mpi_rank == 0) {
+                std::cerr << "Cannot sort by " << name << ": not selected or given twice" << std::endl;
+            }
+            MPI_Finalize();
+            return 1;
+        }
+    }
 
-        auto meta = p / "_metadata";
-        if (fs::is_regular_file(meta)) {
-            metadata_file = meta.string();
-        } else if (mpi_rank == 0) {
-            std::cerr << "WARNING: Input directory '"
-                      << input_directory
-                      << "' did not contain a '_metadata' file"
-                      << std::endl;
+    if (create_index && !(reader_options.columns.selected("source_node_id") &&
+                          reader_options.columns.selected("target_node_id"))) {
+        if (mpi_rank == 0) {
+            std::cerr << "Indexing requires the columns source_node_id and target_node_id, "
+                      << "select them or pass --no-index" << std::endl;
         }
+        MPI_Finalize();
+        return 1;
+    }
 
-        for (const auto& e: fs::directory_iterator(p)) {
-            auto ep = e.path();
-            if (fs::is_regular_file(ep) && ep.extension() == ".parquet") {
-                input_files.push_back(ep.string());
-            }
+    SonataFile::FileTuning tuning;
+    if (tuning_profile == "lustre") {
+        tuning = SonataFile::FileTuning::lustre(stripe_size);
+        MPI_Info_create(&info);
+        MPI_Info_set(info, "striping_unit", std::to_string(stripe_size).c_str());
+    }
+
+    // Only the first rank touches the input directory and the file footers,
+    // all others receive the resulting plan
+    ParquetInput input;
+    {
+        std::string serialized;
+        if (mpi_rank == 0) {
+            input = ParquetInput::scan(input_directory);
+            serialized = input.serialize();
         }
+        uint64_t size = serialized.size();
+        MPI_Bcast(&size, 1, MPI_UINT64_T, 0, comm);
+        serialized.resize(size);
+        MPI_Bcast(serialized.data(), size, MPI_CHAR, 0, comm);
+        if (mpi_rank != 0) {
+            input = ParquetInput::deserialize(serialized);
+        }
+    }
+
+    if (input.metadata_filename.empty() && mpi_rank == 0) {
+        std::cerr << "WARNING: Input directory '"
+                  << input_directory
+                  << "' did not contain a '_metadata' file"
+                  << std::endl;
+    }
 
-        if (input_files.empty()) {
+    if (input.files.empty()) {
+        if (mpi_rank == 0) {
             std::cerr << "Imput directory '"
                       << input_directory
                       << "' did not contain any Parquet files"
                       << std::endl;
-            MPI_Finalize();
-            return 1;
         }
+        MPI_Finalize();
+        return 1;
+    }
+
+    if (append && !fs::exists(output_filename)) {
+        if (mpi_rank == 0) {
+            std::cerr << "Cannot append to missing output '" << output_filename << "'" << std::endl;
+        }
+        MPI_Finalize();
+        return 1;
     }
-    std::sort(input_files.begin(), input_files.end());
 
     if (mpi_rank == 0) {
         auto parent = fs::path(output_filename).parent_path();
@@ -243,8 +548,12 @@ int main(int argc, char* argv[]) {
     }
     MPI_Barrier(comm);
 
-    convert_circuit_mpi(input_files, metadata_file, output_filename, output_population, create_index);
+    convert_circuit_mpi(input, output_filename, output_population, create_index, layout, tuning, reader_options,
+                        sort_by, index_options, index_summary, append);
 
+    if (info != MPI_INFO_NULL) {
+        MPI_Info_free(&info);
+    }
     MPI_Finalize();
 
     return 0;
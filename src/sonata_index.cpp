@@ -0,0 +1,161 @@
+/**
+ * Copyright (C) 2018 Blue Brain Project
+ * All rights reserved. Do not distribute without further notice.
+ *
+ */
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <mpi.h>
+
+#include <highfive/H5File.hpp>
+
+#include "CLI/CLI.hpp"
+
+#include "index/index.h"
+#include "index/summary.h"
+#include "timing.h"
+#include "version.h"
+
+using neuron_parquet::report_timing;
+
+int mpi_size, mpi_rank;
+MPI_Comm comm = MPI_COMM_WORLD;
+
+const char* const EDGES_GROUP = "edges";
+const char* const INDEX_GROUP = "indices";
+
+
+///
+/// \brief index_populations: (Re)creates the indices of the edge \a populations
+///        of \a filename, all populations if empty
+///
+void index_populations(const std::string& filename,
+                       std::vector<std::string> populations,
+                       bool replace,
+                       uint64_t source_node_count,
+                       uint64_t target_node_count,
+                       const indexing::Options& index_options,
+                       const std::string& index_summary) {
+    HighFive::FileAccessProps fapl;
+    fapl.add(HighFive::MPIOFileAccess{comm, MPI_INFO_NULL});
+    HighFive::File file(filename, HighFive::File::ReadWrite, fapl);
+
+    auto edges = file.getGroup(EDGES_GROUP);
+    if (populations.empty()) {
+        populations = edges.listObjectNames();
+    }
+
+    // The node counts are given for a single pair of node populations
+    if (populations.size() > 1 && (source_node_count > 0 || target_node_count > 0)) {
+        throw std::runtime_error(
+            "--source-node-count and --target-node-count require a single population, pass --population");
+    }
+
+    // Check all populations before modifying any
+    for (const auto& population: populations) {
+        if (!edges.exist(population)) {
+            throw std::runtime_error("No edge population " + population + " in " + filename);
+        }
+        if (edges.getGroup(population).exist(INDEX_GROUP) && !replace) {
+            throw std::runtime_error("Population " + population +
+                                     " is already indexed, pass --replace to rebuild its indices");
+        }
+    }
+
+    std::map<std::string, indexing::Summary> summaries;
+    for (const auto& population: populations) {
+        auto group = edges.getGroup(population);
+        if (group.exist(INDEX_GROUP)) {
+            group.unlink(INDEX_GROUP);
+        }
+        if (mpi_rank == 0) {
+            std::cout << "Indexing population " << population << std::endl;
+        }
+        const double start = MPI_Wtime();
+        summaries[population] = indexing::write(group, source_node_count, target_node_count, index_options);
+        report_timing(comm, "indexing " + population, start);
+    }
+
+    if (mpi_rank == 0 && !index_summary.empty()) {
+        indexing::write_summary(index_summary, summaries);
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    // Initialize MPI
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(comm, &mpi_size);
+    MPI_Comm_rank(comm, &mpi_rank);
+
+    std::string filename;
+    std::vector<std::string> populations;
+    bool replace = false;
+    uint64_t source_node_count = 0;
+    uint64_t target_node_count = 0;
+    indexing::Options index_options;
+    std::string index_summary;
+
+    CLI::App app{"Create the indices of the edge populations of a SONATA file"};
+    app.set_version_flag("-v,--version", neuron_parquet::VERSION);
+    app.add_option("--population", populations, "Populations to index, all by default");
+    app.add_flag("--replace", replace,
+                 "Replace existing indices; the space of the old ones is not reclaimed");
+    app.add_option("--source-node-count", source_node_count,
+                   "Number of source nodes of a single population, the highest source node ID plus one by default");
+    app.add_option("--target-node-count", target_node_count,
+                   "Number of target nodes of a single population, the highest target node ID plus one by default");
+    app.add_option("--index-buffer-size", index_options.exchangeBufferSize,
+                   "Bytes sent per rank and round when exchanging index ranges");
+    app.add_flag("!--index-sequential", index_options.overlapGroups,
+                 "Build the source and target indices one after the other, using less memory");
+    auto memory_budget = app.add_option("--index-memory-budget", index_options.memoryBudget,
+                                        "Bytes of memory per rank to build the indices in several passes within");
+    app.add_option("--index-scratch-dir", index_options.scratchDirectory,
+                   "Directory for the ranges of the passes of --index-memory-budget")
+        ->check(CLI::ExistingDirectory)
+        ->needs(memory_budget);
+    app.add_option("--index-threads", index_options.threads,
+                   "Threads per rank grouping and sorting index ranges")
+        ->check(CLI::PositiveNumber);
+    app.add_option("--index-summary", index_summary,
+                   "Write the fragmentation of the indices to this JSON file");
+    app.add_option("--max-ranges-per-node", index_options.maxMeanRangesPerNode,
+                   "Warn when the indices have more ranges per node on average");
+    app.add_flag("--fail-on-fragmentation", index_options.failOnFragmentation,
+                 "Fail instead of warning with --max-ranges-per-node");
+    app.add_option("filename", filename, "SONATA edge file to index")
+        ->check(CLI::ExistingFile)
+        ->required();
+
+    try {
+        app.parse(argc, argv);
+    } catch(const CLI::ParseError& e) {
+        if (mpi_rank == 0) {
+            app.exit(e);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+
+    try {
+        index_populations(filename, populations, replace, source_node_count, target_node_count, index_options,
+                          index_summary);
+    } catch (const std::exception& e) {
+        // Other ranks may be waiting in collective operations
+        std::cerr << "ERROR on rank " << mpi_rank << ": Failed to write indices: " << e.what() << std::endl;
+        MPI_Abort(comm, 1);
+    }
+
+    if(mpi_rank == 0) {
+        std::cout << "Finished indexing " << filename << std::endl;
+    }
+
+    MPI_Finalize();
+
+    return 0;
+}
@@ -0,0 +1,38 @@
+/**
+ * Copyright (C) 2018 Blue Brain Project
+ * All rights reserved. Do not distribute without further notice.
+ *
+ */
+#pragma once
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <mpi.h>
+
+namespace neuron_parquet {
+
+///
+/// \brief report_timing: Prints the fastest and slowest time any rank of \a comm
+///        spent in a phase started at \a start (from MPI_Wtime)
+///
+inline void report_timing(MPI_Comm comm, const std::string& phase, double start) {
+    double elapsed = MPI_Wtime() - start;
+    double fastest, slowest;
+    MPI_Reduce(&elapsed, &fastest, 1, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(&elapsed, &slowest, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    if (rank == 0) {
+        // Formatted apart, so that the precision of std::cout is left alone
+        std::ostringstream message;
+        message << std::fixed << std::setprecision(3)
+                << "Time spent in " << phase << ": "
+                << fastest << "s (fastest rank), "
+                << slowest << "s (slowest rank)";
+        std::cout << message.str() << std::endl;
+    }
+}
+
+}  // namespace neuron_parquet
@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <filesystem>
 
 #include <catch2/catch_test_macros.hpp>
@@ -19,6 +20,8 @@ class MPIFixture {
       MPI_Initialized(&init);
       if (!init) {
           MPI_Init(nullptr, nullptr);
+          // Launchers fail runs whose ranks exit without finalizing
+          std::atexit([]() { MPI_Finalize(); });
       }
           int size;
           MPI_Comm_size(MPI_COMM_WORLD, &size);
@@ -53,6 +56,19 @@ void generate_data(const fs::path& base) {
     indexing::write(g, SOURCE_OFFSET + NNODES, NNODES);
 }
 
+/// Indexes a copy of the node IDs of index_test.h5 in \a path with \a options
+indexing::Summary index_copy(const fs::path& path, const indexing::Options& options) {
+    HighFive::File input("index_test.h5");
+    HighFive::File file(path, HighFive::File::Overwrite);
+    auto g = file.createGroup(GROUP);
+    std::vector<uint64_t> ids;
+    input.getGroup(GROUP).getDataSet("source_node_id").read(ids);
+    g.createDataSet("source_node_id", ids);
+    input.getGroup(GROUP).getDataSet("target_node_id").read(ids);
+    g.createDataSet("target_node_id", ids);
+    return indexing::write(g, SOURCE_OFFSET + NNODES, NNODES, options);
+}
+
 TEST_CASE("Indexing") {
     MPIFixture fixed;
 
@@ -111,3 +127,203 @@ TEST_CASE("Indexing") {
         }
     }
 }
+
+
+TEST_CASE("Indexing sorted node IDs spanning ranks", "[mpi]") {
+    MPIFixture fixed;
+
+    // With three ranks, every rank reads three edges: source node 1 spans all
+    // ranks, the middle one holding a single range of it, and target node 5
+    // has a single range on every rank
+    const std::vector<uint64_t> source_ids{0, 1, 1, 1, 1, 1, 1, 2, 2};
+    const std::vector<uint64_t> target_ids(source_ids.size(), 5);
+
+    HighFive::FileAccessProps fapl;
+    fapl.add(HighFive::MPIOFileAccess{MPI_COMM_WORLD, MPI_INFO_NULL});
+    {
+        HighFive::File file("index_spanning_test.h5", HighFive::File::Overwrite, fapl);
+        auto g = file.createGroup(GROUP);
+        g.createDataSet("source_node_id", source_ids);
+        g.createDataSet("target_node_id", target_ids);
+        indexing::write(g, 3, 6);
+    }
+
+    HighFive::File file("index_spanning_test.h5", HighFive::File::ReadOnly, fapl);
+    auto indices = file.getGroup(GROUP).getGroup("indices");
+    std::vector<std::array<uint64_t, 2>> ranges;
+    std::vector<std::array<uint64_t, 2>> edges;
+
+    indices.getGroup("source_to_target").getDataSet("node_id_to_ranges").read(ranges);
+    indices.getGroup("source_to_target").getDataSet("range_to_edge_id").read(edges);
+    REQUIRE(ranges == std::vector<std::array<uint64_t, 2>>{{0, 1}, {1, 2}, {2, 3}});
+    REQUIRE(edges == std::vector<std::array<uint64_t, 2>>{{0, 1}, {1, 7}, {7, 9}});
+
+    indices.getGroup("target_to_source").getDataSet("node_id_to_ranges").read(ranges);
+    indices.getGroup("target_to_source").getDataSet("range_to_edge_id").read(edges);
+    REQUIRE(ranges == std::vector<std::array<uint64_t, 2>>{{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 1}});
+    REQUIRE(edges == std::vector<std::array<uint64_t, 2>>{{0, 9}});
+}
+
+
+void compare_indices(const fs::path& expected_path, const fs::path& actual_path) {
+    HighFive::File expected_file(expected_path);
+    HighFive::File actual_file(actual_path);
+    for (const auto& name: {"indices/source_to_target", "indices/target_to_source"}) {
+        auto expected = expected_file.getGroup(GROUP).getGroup(name);
+        auto actual = actual_file.getGroup(GROUP).getGroup(name);
+        for (const auto& dataset: {"node_id_to_ranges", "range_to_edge_id"}) {
+            std::vector<std::array<uint64_t, 2>> expected_data;
+            std::vector<std::array<uint64_t, 2>> actual_data;
+            expected.getDataSet(dataset).read(expected_data);
+            actual.getDataSet(dataset).read(actual_data);
+            REQUIRE(actual_data == expected_data);
+        }
+    }
+}
+
+TEST_CASE("Indexing from collected ranges") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    // Edges as written by a single rank
+    indexing::RangeCollector source_collector;
+    indexing::RangeCollector target_collector;
+    for (size_t i = 0; i < NNODES; ++i) {
+        for (size_t j = 0; j < NNODES; ++j) {
+            source_collector.add(SOURCE_OFFSET + i, NNODES * i + j);
+            target_collector.add(j, NNODES * i + j);
+        }
+    }
+    {
+        HighFive::File file("index_ranges_test.h5", HighFive::File::Overwrite);
+        auto g = file.createGroup(GROUP);
+        indexing::write(g, SOURCE_OFFSET + NNODES, NNODES,
+                        source_collector.release(), target_collector.release());
+    }
+
+    compare_indices("index_test.h5", "index_ranges_test.h5");
+}
+
+TEST_CASE("Updating the indices of appended edges") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    // The first half of the source nodes written first, the others appended
+    const size_t first_edges = NNODES * NNODES / 2;
+    indexing::RangeCollector source_collector;
+    indexing::RangeCollector target_collector;
+    auto collect = [&](size_t begin, size_t end) {
+        for (size_t edge = begin; edge < end; ++edge) {
+            source_collector.add(SOURCE_OFFSET + edge / NNODES, edge);
+            target_collector.add(edge % NNODES, edge);
+        }
+    };
+    {
+        HighFive::File file("index_update_test.h5", HighFive::File::Overwrite);
+        auto g = file.createGroup(GROUP);
+        collect(0, first_edges);
+        indexing::write(g, SOURCE_OFFSET + NNODES, NNODES,
+                        source_collector.release(), target_collector.release());
+        collect(first_edges, NNODES * NNODES);
+        indexing::update(g, 0, 0, source_collector.release(), target_collector.release());
+    }
+
+    compare_indices("index_test.h5", "index_update_test.h5");
+}
+
+TEST_CASE("Indexing with a small exchange buffer") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    indexing::Options options;
+    // Exchange a single range per round
+    options.exchangeBufferSize = 1;
+    index_copy("index_buffer_test.h5", options);
+
+    compare_indices("index_test.h5", "index_buffer_test.h5");
+}
+
+TEST_CASE("Indexing one group at a time") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    indexing::Options options;
+    options.overlapGroups = false;
+    index_copy("index_sequential_test.h5", options);
+
+    compare_indices("index_test.h5", "index_sequential_test.h5");
+}
+
+TEST_CASE("Indexing within a memory budget") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    indexing::Options options;
+    // A pass per node, reading the node IDs a few at a time
+    options.memoryBudget = 64;
+    std::string scratch;
+    SECTION("Reading node IDs for every pass") {}
+    SECTION("Setting ranges aside") {
+        scratch = "index_scratch";
+        fs::create_directories(scratch);
+        options.scratchDirectory = scratch;
+    }
+    index_copy("index_budget_test.h5", options);
+
+    compare_indices("index_test.h5", "index_budget_test.h5");
+    if (!scratch.empty()) {
+        REQUIRE(fs::is_empty(scratch));
+    }
+}
+
+TEST_CASE("Indexing with several threads") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    indexing::Options options;
+    // Chunks of node IDs that do not align with the node boundaries
+    options.threads = 3;
+    index_copy("index_threads_test.h5", options);
+
+    compare_indices("index_test.h5", "index_threads_test.h5");
+}
+
+TEST_CASE("Index fragmentation") {
+    MPIFixture fixed;
+
+    generate_data("index_test.h5");
+
+    {
+        HighFive::File input("index_test.h5");
+        auto indices = input.getGroup(GROUP).getGroup("indices");
+        uint64_t ranges, edges;
+        double mean;
+        indices.getGroup("source_to_target").getAttribute("total_ranges").read(ranges);
+        REQUIRE(ranges == NNODES);
+        indices.getGroup("source_to_target").getAttribute("total_edges").read(edges);
+        REQUIRE(edges == NNODES * NNODES);
+        indices.getGroup("target_to_source").getAttribute("mean_ranges_per_node").read(mean);
+        REQUIRE(mean == NNODES);
+    }
+
+    indexing::Options options;
+    options.maxMeanRangesPerNode = NNODES / 2;
+    options.failOnFragmentation = true;
+    REQUIRE_THROWS(index_copy("index_fragmentation_test.h5", options));
+
+    options.failOnFragmentation = false;
+    const auto summary = index_copy("index_fragmentation_test.h5", options);
+    REQUIRE(summary.source.nodes == NNODES);
+    REQUIRE(summary.source.maxRangesPerNode == 1);
+    REQUIRE(summary.source.edgesPerRange == NNODES);
+    REQUIRE(summary.target.ranges == NNODES * NNODES);
+    REQUIRE(summary.target.minRangesPerNode == NNODES);
+    REQUIRE(summary.target.p99RangesPerNode == NNODES);
+    REQUIRE(summary.target.edgesPerRange == 1);
+}
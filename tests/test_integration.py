@@ -1,7 +1,11 @@
+import h5py
 import libsonata
 import numpy as np
 import numpy.testing as npt
 import pandas as pd
+import pyarrow as pa
+import pyarrow.parquet as pq
+import pytest
 import subprocess
 import tempfile
 from pathlib import Path
@@ -21,6 +25,18 @@ def generate_data(
     if nfiles < 1:
         raise RuntimeError("need 1+ files to generate")
 
+    df = generate_edges(source_nodes, target_nodes, avg_connections)
+    write_files(df, location, nfiles)
+
+    return df
+
+
+def generate_edges(
+    source_nodes: int = 100,
+    target_nodes: int = 100,
+    avg_connections: int = 100,
+) -> pd.DataFrame:
+    """Generate SONATA test data sorted by source node."""
     sids = []
     tids = []
 
@@ -46,21 +62,36 @@ def generate_data(
         }
     )
 
+    return df
+
+
+def write_files(df: pd.DataFrame, location: Path, nfiles: int = 3, **kwargs):
+    """Split `df` at random into `nfiles` Parquet files in `location`.
+
+    Keyword arguments are passed on to `DataFrame.to_parquet`.
+    """
+    rng = np.random.default_rng()
     divisions = [0]
     divisions.extend(
         np.sort(
             rng.choice(
-                np.arange(1, len(sids)), nfiles - 1, replace=False, shuffle=False
+                np.arange(1, len(df)), nfiles - 1, replace=False, shuffle=False
             )
         )
     )
-    divisions.append(len(sids))
+    divisions.append(len(df))
 
     for i in range(nfiles):
         slice = df.iloc[divisions[i] : divisions[i + 1]]
-        slice.to_parquet(location / f"data{i}.parquet")
+        slice.to_parquet(location / f"data{i}.parquet", **kwargs)
 
-    return df
+
+def convert(parquet_name: Path, sonata_name: Path, population_name: str, *args, ranks: int = 1):
+    """Run parquet2hdf5 with the options `args` on `ranks` MPI ranks."""
+    command = ["parquet2hdf5", *args, parquet_name, sonata_name, population_name]
+    if ranks > 1:
+        command = ["mpirun", "--oversubscribe", "-np", str(ranks), *command]
+    subprocess.check_call(command, timeout=600)
 
 
 def test_conversion():
@@ -101,5 +132,344 @@ def test_conversion():
         )
 
 
+def test_string_columns():
+    with tempfile.TemporaryDirectory() as dirname:
+        tmpdir = Path(dirname)
+
+        parquet_name = tmpdir / "data.parquet"
+        parquet_name.mkdir(parents=True, exist_ok=True)
+        sonata_name = tmpdir / "data.h5"
+        population_name = "cells__cells__test"
+
+        rng = np.random.default_rng()
+        df = generate_edges()
+        df["mtype"] = rng.choice(["L6_TPC", "L1_DAC", "L23_PC", "L4_SS"], len(df))
+        # Dictionary pages in some files, values decoded from the data in others
+        write_files(df.iloc[: len(df) // 2], parquet_name, 2)
+        df.iloc[len(df) // 2 :].to_parquet(
+            parquet_name / "plain.parquet", use_dictionary=False
+        )
+
+        convert(parquet_name, sonata_name, population_name, ranks=3)
+
+        pop = libsonata.EdgeStorage(sonata_name).open_population(population_name)
+        assert "mtype" in pop.enumeration_names
+        library = pop.enumeration_values("mtype")
+        assert library == sorted(df["mtype"].unique())
+        indices = pop.get_enumeration("mtype", pop.select_all())
+        npt.assert_array_equal(np.array(library)[indices], df["mtype"])
+
+
+@pytest.mark.parametrize("options", [[], ["--compression", "deflate"]])
+def test_nested_columns(options):
+    with tempfile.TemporaryDirectory() as dirname:
+        tmpdir = Path(dirname)
+
+        parquet_name = tmpdir / "data.parquet"
+        parquet_name.mkdir(parents=True, exist_ok=True)
+        sonata_name = tmpdir / "data.h5"
+        population_name = "cells__cells__test"
+
+        rng = np.random.default_rng()
+        df = generate_edges()
+        positions = rng.standard_normal((len(df), 3)).astype(np.float32)
+        sections = rng.integers(low=0, high=1000, size=(len(df), 2), dtype=np.int32)
+
+        table = pa.Table.from_pandas(df, preserve_index=False)
+        table = table.append_column(
+            "position",
+            pa.FixedSizeListArray.from_arrays(pa.array(positions.ravel()), 3),
+        )
+        table = table.append_column(
+            "section",
+            pa.StructArray.from_arrays(
+                [pa.array(sections[:, 0]), pa.array(sections[:, 1])], ["pre", "post"]
+            ),
+        )
+        half = len(df) // 2
+        pq.write_table(table.slice(0, half), parquet_name / "data0.parquet")
+        pq.write_table(table.slice(half), parquet_name / "data1.parquet")
+
+        convert(parquet_name, sonata_name, population_name, *options, ranks=2)
+
+        with h5py.File(sonata_name, "r") as h5:
+            group = h5[f"edges/{population_name}/0"]
+            assert group["position"].shape == (len(df), 3)
+            assert group["position"].dtype == np.float32
+            npt.assert_array_equal(group["position"][:], positions)
+            assert group["section"].shape == (len(df), 2)
+            assert group["section"].dtype == np.int32
+            npt.assert_array_equal(group["section"][:], sections)
+            npt.assert_array_equal(
+                h5[f"edges/{population_name}/source_node_id"][:], df["source_node_id"]
+            )
+
+
+def read_edges(sonata_name: Path, population_name: str, attributes) -> pd.DataFrame:
+    """Read the node IDs and `attributes` of a population into a DataFrame."""
+    pop = libsonata.EdgeStorage(sonata_name).open_population(population_name)
+    selection = pop.select_all()
+    columns = {
+        "source_node_id": pop.source_nodes(selection),
+        "target_node_id": pop.target_nodes(selection),
+    }
+    for name in attributes:
+        columns[name] = pop.get_attribute(name, selection)
+    return pd.DataFrame(columns)
+
+
+def test_sort_by():
+    with tempfile.TemporaryDirectory() as dirname:
+        tmpdir = Path(dirname)
+
+        parquet_name = tmpdir / "data.parquet"
+        parquet_name.mkdir(parents=True, exist_ok=True)
+        sonata_name = tmpdir / "data.h5"
+        population_name = "cells__cells__test"
+
+        # Shuffled, so that every rank holds rows of every target
+        df = generate_edges().sample(frac=1).reset_index(drop=True)
+        write_files(df, parquet_name, 4)
+
+        convert(
+            parquet_name,
+            sonata_name,
+            population_name,
+            "--sort-by",
+            "target_node_id,source_node_id",
+            ranks=3,
+        )
+
+        attributes = ["my_attribute", "my_other_attribute"]
+        result = read_edges(sonata_name, population_name, attributes)
+        keys = list(zip(result["target_node_id"], result["source_node_id"]))
+        assert keys == sorted(keys)
+
+        # The same rows, in any order among equal keys
+        columns = ["source_node_id", "target_node_id", *attributes]
+        expected = df[columns].sort_values(columns).reset_index(drop=True)
+        pd.testing.assert_frame_equal(
+            result.sort_values(columns).reset_index(drop=True),
+            expected,
+            check_dtype=False,
+        )
+
+
+def compare_populations(sonata_name: Path, expected_name: Path, population_name: str):
+    """Check that two files hold the same edges, enumerations and indices."""
+    pop = libsonata.EdgeStorage(sonata_name).open_population(population_name)
+    expected = libsonata.EdgeStorage(expected_name).open_population(population_name)
+    assert len(pop) == len(expected)
+    selection = pop.select_all()
+
+    npt.assert_array_equal(pop.source_nodes(selection), expected.source_nodes(selection))
+    npt.assert_array_equal(pop.target_nodes(selection), expected.target_nodes(selection))
+    for name in expected.attribute_names:
+        if name in expected.enumeration_names:
+            # Libraries may differ in order, the values they resolve to may not
+            values = np.array(pop.enumeration_values(name))
+            expected_values = np.array(expected.enumeration_values(name))
+            npt.assert_array_equal(
+                values[pop.get_enumeration(name, selection)],
+                expected_values[expected.get_enumeration(name, selection)],
+            )
+        else:
+            npt.assert_array_equal(
+                pop.get_attribute(name, selection), expected.get_attribute(name, selection)
+            )
+
+    for node in range(max(expected.source_nodes(selection)) + 1):
+        npt.assert_array_equal(
+            np.sort(pop.efferent_edges([node]).flatten()),
+            np.sort(expected.efferent_edges([node]).flatten()),
+        )
+    for node in range(max(expected.target_nodes(selection)) + 1):
+        npt.assert_array_equal(
+            np.sort(pop.afferent_edges([node]).flatten()),
+            np.sort(expected.afferent_edges([node]).flatten()),
+        )
+
+
+@pytest.mark.parametrize(
+    "options", [["--chunk-size", "500"], ["--compression", "deflate"]]
+)
+def test_append(options):
+    with tempfile.TemporaryDirectory() as dirname:
+        tmpdir = Path(dirname)
+
+        first_name = tmpdir / "first.parquet"
+        second_name = tmpdir / "second.parquet"
+        both_name = tmpdir / "both.parquet"
+        for name in (first_name, second_name, both_name):
+            name.mkdir(parents=True, exist_ok=True)
+        sonata_name = tmpdir / "data.h5"
+        expected_name = tmpdir / "expected.h5"
+        population_name = "cells__cells__test"
+
+        rng = np.random.default_rng()
+        first = generate_edges()
+        first["mtype"] = rng.choice(["L1_DAC", "L23_PC"], len(first))
+        second = generate_edges(source_nodes=120)
+        second["mtype"] = rng.choice(["L23_PC", "L4_SS", "L6_TPC"], len(second))
+
+        # Uneven row groups: ranks write different numbers of blocks
+        first.to_parquet(first_name / "data0.parquet")
+        second.iloc[:1000].to_parquet(second_name / "data0.parquet", row_group_size=100)
+        second.iloc[1000:].to_parquet(second_name / "data1.parquet")
+        first.to_parquet(both_name / "data0.parquet")
+        second.iloc[:1000].to_parquet(both_name / "data1.parquet", row_group_size=100)
+        second.iloc[1000:].to_parquet(both_name / "data2.parquet")
+
+        convert(first_name, sonata_name, population_name, *options, ranks=3)
+        # The layout is taken from the existing datasets, not repeated
+        convert(second_name, sonata_name, population_name, "--append", ranks=3)
+        convert(both_name, expected_name, population_name, *options, ranks=3)
+
+        compare_populations(sonata_name, expected_name, population_name)
+
+        # Existing library values keep their positions
+        pop = libsonata.EdgeStorage(sonata_name).open_population(population_name)
+        library = pop.enumeration_values("mtype")
+        assert library[:2] == ["L1_DAC", "L23_PC"]
+        assert sorted(library[2:]) == ["L4_SS", "L6_TPC"]
+
+
+def test_append_mismatch():
+    with tempfile.TemporaryDirectory() as dirname:
+        tmpdir = Path(dirname)
+
+        first_name = tmpdir / "first.parquet"
+        second_name = tmpdir / "second.parquet"
+        for name in (first_name, second_name):
+            name.mkdir(parents=True, exist_ok=True)
+        sonata_name = tmpdir / "data.h5"
+        population_name = "cells__cells__test"
+
+        first = generate_data(first_name)
+        convert(first_name, sonata_name, population_name, "--chunk-size", "500")
+
+        # Changed type of a column
+        second = generate_edges()
+        second["my_other_attribute"] = second["my_other_attribute"].astype(np.float32)
+        second.to_parquet(second_name / "data0.parquet")
+        with pytest.raises(subprocess.CalledProcessError):
+            convert(second_name, sonata_name, population_name, "--append")
+
+        # Missing column
+        second.drop(columns=["my_other_attribute"]).to_parquet(second_name / "data0.parquet")
+        with pytest.raises(subprocess.CalledProcessError):
+            convert(second_name, sonata_name, population_name, "--append")
+
+        pop = libsonata.EdgeStorage(sonata_name).open_population(population_name)
+        assert len(pop) == len(first)
+
+
+def convert_both(tmpdir: Path, *options, ranks: int = 2):
+    """Convert generated data with `options` and with the default options.
+
+    Returns the names of both files and of the population.
+    """
+    parquet_name = tmpdir / "data.parquet"
+    parquet_name.mkdir(parents=True, exist_ok=True)
+    sonata_name = tmpdir / "data.h5"
+    expected_name = tmpdir / "expected.h5"
+    population_name = "cells__cells__test"
+
+    generate_data(parquet_name, nfiles=4)
+    convert(parquet_name, sonata_name, population_name, *options, ranks=ranks)
+    convert(parquet_name, expected_name, population_name, ranks=ranks)
+    return sonata_name, expected_name, population_name
+
+
+@pytest.mark.parametrize(
+    "options",
+    [
+        ["--chunk-size", "1000"],
+        ["--compression", "deflate", "--shuffle", "--compression-level", "6"],
+        ["--compression", "deflate", "--checksum", "--chunk-size", "300"],
+    ],
+)
+def test_layouts(options):
+    with tempfile.TemporaryDirectory() as dirname:
+        sonata_name, expected_name, population_name = convert_both(Path(dirname), *options)
+        compare_populations(sonata_name, expected_name, population_name)
+
+        with h5py.File(sonata_name, "r") as h5:
+            dataset = h5[f"edges/{population_name}/0/my_attribute"]
+            assert dataset.chunks is not None
+            if "--chunk-size" in options:
+                size = int(options[options.index("--chunk-size") + 1])
+                assert dataset.chunks == (min(size, dataset.shape[0]),)
+            assert dataset.compression == ("gzip" if "--compression" in options else None)
+            assert dataset.shuffle == ("--shuffle" in options)
+            assert dataset.fletcher32 == ("--checksum" in options)
+
+
+def test_lustre_tuning():
+    with tempfile.TemporaryDirectory() as dirname:
+        stripe_size = 65536
+        sonata_name, expected_name, population_name = convert_both(
+            Path(dirname), "--tuning", "lustre", "--stripe-size", str(stripe_size)
+        )
+        compare_populations(sonata_name, expected_name, population_name)
+
+        with h5py.File(sonata_name, "r") as h5:
+            profile = h5.attrs["tuning_profile"]
+            assert (profile.decode() if isinstance(profile, bytes) else profile) == "lustre"
+            assert h5.attrs["tuning_alignment"] == stripe_size
+            assert h5.attrs["tuning_page_size"] == stripe_size
+            assert h5.attrs["tuning_metadata_block_size"] == stripe_size
+            assert h5.attrs["tuning_fill_values"] == 0
+        with h5py.File(expected_name, "r") as h5:
+            profile = h5.attrs["tuning_profile"]
+            assert (profile.decode() if isinstance(profile, bytes) else profile) == "default"
+
+
+@pytest.mark.parametrize(
+    "options", [["--batch-rows", "100"], ["--batch-bytes", "4096"]]
+)
+def test_streaming(options):
+    with tempfile.TemporaryDirectory() as dirname:
+        sonata_name, expected_name, population_name = convert_both(Path(dirname), *options)
+        compare_populations(sonata_name, expected_name, population_name)
+
+
+@pytest.mark.parametrize("columns", [1, 2])
+def test_columns_per_read(columns):
+    with tempfile.TemporaryDirectory() as dirname:
+        sonata_name, expected_name, population_name = convert_both(
+            Path(dirname), "--columns-per-read", str(columns)
+        )
+        compare_populations(sonata_name, expected_name, population_name)
+
+
+@pytest.mark.parametrize("size", [4096, 1 << 20])
+def test_write_buffer(size):
+    with tempfile.TemporaryDirectory() as dirname:
+        # Small row groups, so that many writes are staged
+        tmpdir = Path(dirname)
+        parquet_name = tmpdir / "data.parquet"
+        parquet_name.mkdir(parents=True, exist_ok=True)
+        sonata_name = tmpdir / "data.h5"
+        expected_name = tmpdir / "expected.h5"
+        population_name = "cells__cells__test"
+
+        df = generate_edges()
+        write_files(df, parquet_name, 3, row_group_size=50)
+        convert(parquet_name, sonata_name, population_name, "--write-buffer-size", str(size), ranks=2)
+        convert(parquet_name, expected_name, population_name, ranks=2)
+        compare_populations(sonata_name, expected_name, population_name)
+
+
 if __name__ == "__main__":
     test_conversion()
+    test_string_columns()
+    test_nested_columns([])
+    test_sort_by()
+    test_append(["--chunk-size", "500"])
+    test_append_mismatch()
+    test_layouts(["--chunk-size", "1000"])
+    test_lustre_tuning()
+    test_streaming(["--batch-rows", "100"])
+    test_columns_per_read(1)
+    test_write_buffer(4096)